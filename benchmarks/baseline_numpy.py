@@ -10,6 +10,9 @@ print("$OPENBLAS_NUM_THREADS:", os.environ.get("OPENBLAS_NUM_THREADS"))
 print("$MKL_NUM_THREADS:", os.environ.get("MKL_NUM_THREADS"))
 print("$OMP_NUM_THREADS:", os.environ.get("OMP_NUM_THREADS"))
 
+# when set, each size's A, B and C = A @ B are saved there as .npy, for `./matrix --npy A.npy B.npy C.npy`
+npy_dir = os.environ.get("MATRIX_NPY_DIR")
+
 import numpy as np
 import time
 
@@ -30,6 +33,12 @@ def benchmark_matmul(M, N, K, num_iterations):
         flops = 2.0 * M * N * K
         flops_per_second = flops / iteration_time / 1e9
 
+    if npy_dir:
+        os.makedirs(npy_dir, exist_ok=True)
+        np.save(os.path.join(npy_dir, f"A_{M}x{K}.npy"), A)
+        np.save(os.path.join(npy_dir, f"B_{K}x{N}.npy"), B)
+        np.save(os.path.join(npy_dir, f"C_{M}x{N}.npy"), C)
+
     return flops_per_second
 
 def main():
@@ -0,0 +1,2960 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define MATRIX_X86
+#endif
+
+// how a Matrix's data was obtained, so free_matrix can hand it back the same way
+// views and wrapped memory are ALLOC_NONE and free_matrix leaves them alone
+typedef enum {
+    ALLOC_NONE,
+    ALLOC_HEAP,     // aligned_alloc
+    ALLOC_MMAP,     // anonymous mapping (huge pages)
+    ALLOC_FILE,     // private mapping of a .npy file, alloc_bytes covers header + data (see load_npy)
+} AllocKind;
+
+typedef struct {
+    int depth;
+    int rows;
+    int cols;
+    int stride;     // row pitch (leading dimension) in floats, cols (or padded, see AllocPolicy) for owned matrices, the parent's for views
+    size_t length;  // elements, depth * rows * cols
+    float *data;
+    AllocKind alloc;
+    size_t alloc_bytes;
+} Matrix;
+
+// allocation policy for allocate_matrix_*, data is always 64 byte aligned (a cache line, one AVX-512 load)
+// pad_stride rounds the row pitch of wide matrices up to whole cache lines and steps it off multiples of
+// 512 bytes: with a 512 or 1024 float pitch every 8th (or 4th) row lands in the same L1 set and loads
+// 4K-alias against stores to the row below
+// huge_pages backs matrices of 2M and up with 2M pages, transparent ones (madvise) or explicit ones
+// (MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages, falls back to transparent), so the
+// 4k-8k sizes stop missing the TLB on every few rows
+// MATRIX_PAD_STRIDE=1 and MATRIX_HUGE_PAGES=thp|hugetlb set it at startup, programs can also change it
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT,
+} HugePages;
+
+typedef struct {
+    int pad_stride;
+    HugePages huge_pages;
+} AllocPolicy;
+
+AllocPolicy alloc_policy = {0, HUGE_PAGES_OFF};
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+__attribute__((constructor))
+void load_alloc_policy(void) {
+    const char *pad = getenv("MATRIX_PAD_STRIDE");
+    if (pad != NULL) {
+        alloc_policy.pad_stride = atoi(pad) != 0;
+    }
+    const char *huge = getenv("MATRIX_HUGE_PAGES");
+    if (huge != NULL) {
+        if (strcmp(huge, "thp") == 0) {
+            alloc_policy.huge_pages = HUGE_PAGES_TRANSPARENT;
+        } else if (strcmp(huge, "hugetlb") == 0) {
+            alloc_policy.huge_pages = HUGE_PAGES_EXPLICIT;
+        } else {
+            alloc_policy.huge_pages = HUGE_PAGES_OFF;
+        }
+    }
+}
+
+// row pitch for a new matrix, narrow ones aren't padded (their rows don't reach the next set anyway)
+int padded_stride(int cols) {
+    if (!alloc_policy.pad_stride || cols < 128 || cols > INT_MAX - 32) {
+        return cols;
+    }
+    int stride = (cols + 15) & ~15;
+    if (stride % 128 == 0) {
+        stride += 16;
+    }
+    return stride;
+}
+
+// zero filled and 64 byte aligned, the size actually reserved goes to *alloc_bytes for free_matrix
+float *matrix_alloc(size_t bytes, AllocKind *kind, size_t *alloc_bytes) {
+    bytes = (bytes + 63) & ~(size_t)63;
+#ifdef __linux__
+    if (alloc_policy.huge_pages != HUGE_PAGES_OFF && bytes >= HUGE_PAGE_SIZE) {
+        size_t size = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        if (alloc_policy.huge_pages == HUGE_PAGES_EXPLICIT) {
+            void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                *kind = ALLOC_MMAP;
+                *alloc_bytes = size;
+                return (float *)p;
+            }
+        }
+        // transparent huge pages only cover 2M aligned ranges, so map 2M extra and trim both ends
+        char *p = (char *)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            char *aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if (aligned != p) {
+                munmap(p, aligned - p);
+            }
+            munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+            madvise(aligned, size, MADV_HUGEPAGE);
+            *kind = ALLOC_MMAP;
+            *alloc_bytes = size;
+            return (float *)aligned;
+        }
+    }
+#endif
+    float *p = (float *)aligned_alloc(64, bytes);
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(p, 0, bytes);
+    *kind = ALLOC_HEAP;
+    *alloc_bytes = bytes;
+    return p;
+}
+
+// dimensions are int, everything derived from them (lengths, byte counts, offsets) is size_t,
+// a shape that is negative or whose bytes don't fit in a size_t fails here instead of wrapping around
+size_t checked_bytes(int depth, int rows, int cols, size_t elem_size) {
+    size_t bytes;
+    if (depth < 0 || rows < 0 || cols < 0
+        || __builtin_mul_overflow((size_t)depth, (size_t)rows, &bytes)
+        || __builtin_mul_overflow(bytes, (size_t)cols, &bytes)
+        || __builtin_mul_overflow(bytes, elem_size, &bytes)
+        || bytes > SIZE_MAX - (4 << 20)) {
+        fprintf(stderr, "Matrix too large: %d x %d x %d\n", depth, rows, cols);
+        exit(1);
+    }
+    return bytes;
+}
+
+void allocate_matrix_zeros(Matrix *m, int depth, int rows, int cols) {
+    size_t bytes = checked_bytes(depth, rows, cols, sizeof(float));
+    m->depth = depth;
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = padded_stride(cols);
+    m->length = bytes / sizeof(float);
+    m->data = matrix_alloc(checked_bytes(depth, rows, m->stride, sizeof(float)), &m->alloc, &m->alloc_bytes);
+}
+
+void allocate_matrix_random(Matrix *m, int depth, int rows, int cols) {
+    allocate_matrix_zeros(m, depth, rows, cols);
+
+    srand(time(NULL));
+    for (int d = 0; d < depth; d++) {
+        for (int r = 0; r < rows; r++) {
+            float *row = m->data + ((size_t)d * rows + r) * m->stride;
+            for (int c = 0; c < cols; c++) {
+                row[c] = (float)rand() / RAND_MAX;
+            }
+        }
+    }
+}
+
+void allocate_matrix_consecutive(Matrix *m, int depth, int rows, int cols) {
+    allocate_matrix_zeros(m, depth, rows, cols);
+
+    // values count elements, not storage, so a padded pitch gives the same matrix
+    for (int d = 0; d < depth; d++) {
+        for (int r = 0; r < rows; r++) {
+            float *row = m->data + ((size_t)d * rows + r) * m->stride;
+            for (int c = 0; c < cols; c++) {
+                row[c] = (float)(((size_t)d * rows + r) * cols + c);
+            }
+        }
+    }
+}
+
+void free_matrix(Matrix *m) {
+    if (m->alloc == ALLOC_HEAP) {
+        free(m->data);
+    }
+    if (m->alloc == ALLOC_MMAP) {
+        munmap(m->data, m->alloc_bytes);
+    }
+    if (m->alloc == ALLOC_FILE) {
+        munmap((char *)m->data - (m->alloc_bytes - m->length * sizeof(float)), m->alloc_bytes);
+    }
+    m->data = NULL;
+    m->alloc = ALLOC_NONE;
+}
+
+// 64-bit, a 46k x 46k slice already has more than 2^31 elements
+size_t strided_index(Matrix *m, int d, int r, int c) {
+    return ((size_t)d * m->rows + r) * m->stride + c;
+}
+
+// no-copy rows x cols window starting at (r, c) of depth slice d, it shares m's memory,
+// so writes land in m, free_matrix leaves it alone
+void view(Matrix *m, int d, int r, int c, int rows, int cols, Matrix *v) {
+    v->depth = 1;
+    v->rows = rows;
+    v->cols = cols;
+    v->stride = m->stride;
+    v->length = (size_t)rows * cols;
+    v->data = m->data + strided_index(m, d, r, c);
+    v->alloc = ALLOC_NONE;
+}
+
+// slice d as a depth-1 view, a depth-1 m hands out its only slice for every d (broadcasting)
+void slice(Matrix *m, int d, Matrix *s) {
+    view(m, m->depth == 1 ? 0 : d, 0, 0, m->rows, m->cols, s);
+}
+
+float get(Matrix *m, int d, int r, int c) {
+    return m->data[strided_index(m, d, r, c)];
+}
+
+void set(Matrix *m, int d, int r, int c, float value) {
+    m->data[strided_index(m, d, r, c)] = value;
+}
+
+// avoiding get and set due to significant function overhead
+// transposes are blocked: 32x32 blocks keep both the rows read and the columns written in L1,
+// and inside a block every full 8x8 tile goes through registers in one piece
+// (eight row loads, unpack/shuffle/permute, eight row stores, AVX when the cpu has it)
+#define TRANSPOSE_BLOCK 32
+
+typedef void (*transpose_8x8_fn)(const float *src, int lds, float *dst, int ldd);
+
+void transpose_8x8_generic(const float *src, int lds, float *dst, int ldd) {
+    for (int r = 0; r < 8; r++) {
+        for (int c = 0; c < 8; c++) {
+            dst[c * ldd + r] = src[r * lds + c];
+        }
+    }
+}
+
+#ifdef MATRIX_X86
+__attribute__((target("avx")))
+void transpose_8x8_avx(const float *src, int lds, float *dst, int ldd) {
+    __m256 r0 = _mm256_loadu_ps(src + 0 * lds);
+    __m256 r1 = _mm256_loadu_ps(src + 1 * lds);
+    __m256 r2 = _mm256_loadu_ps(src + 2 * lds);
+    __m256 r3 = _mm256_loadu_ps(src + 3 * lds);
+    __m256 r4 = _mm256_loadu_ps(src + 4 * lds);
+    __m256 r5 = _mm256_loadu_ps(src + 5 * lds);
+    __m256 r6 = _mm256_loadu_ps(src + 6 * lds);
+    __m256 r7 = _mm256_loadu_ps(src + 7 * lds);
+
+    // interleave row pairs, then pairs of pairs, every 128 bit lane now holds one 4x4 quarter
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+    __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+    __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+    __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    // swap the off-diagonal lanes
+    _mm256_storeu_ps(dst + 0 * ldd, _mm256_permute2f128_ps(s0, s4, 0x20));
+    _mm256_storeu_ps(dst + 1 * ldd, _mm256_permute2f128_ps(s1, s5, 0x20));
+    _mm256_storeu_ps(dst + 2 * ldd, _mm256_permute2f128_ps(s2, s6, 0x20));
+    _mm256_storeu_ps(dst + 3 * ldd, _mm256_permute2f128_ps(s3, s7, 0x20));
+    _mm256_storeu_ps(dst + 4 * ldd, _mm256_permute2f128_ps(s0, s4, 0x31));
+    _mm256_storeu_ps(dst + 5 * ldd, _mm256_permute2f128_ps(s1, s5, 0x31));
+    _mm256_storeu_ps(dst + 6 * ldd, _mm256_permute2f128_ps(s2, s6, 0x31));
+    _mm256_storeu_ps(dst + 7 * ldd, _mm256_permute2f128_ps(s3, s7, 0x31));
+}
+#endif
+
+// picked next to the gemm kernel in select_kernels()
+transpose_8x8_fn transpose_8x8 = transpose_8x8_generic;
+
+// dst (cols x rows, row stride ldd) = src (rows x cols, row stride lds) transposed, the two must not overlap
+void transpose_block(const float *src, int lds, float *dst, int ldd, int rows, int cols) {
+    for (int rb = 0; rb < rows; rb += TRANSPOSE_BLOCK) {
+        for (int cb = 0; cb < cols; cb += TRANSPOSE_BLOCK) {
+            int r_end = rb + TRANSPOSE_BLOCK < rows ? rb + TRANSPOSE_BLOCK : rows;
+            int c_end = cb + TRANSPOSE_BLOCK < cols ? cb + TRANSPOSE_BLOCK : cols;
+            for (int r = rb; r < r_end; r += 8) {
+                for (int c = cb; c < c_end; c += 8) {
+                    if (r + 8 <= r_end && c + 8 <= c_end) {
+                        transpose_8x8(src + (size_t)r * lds + c, lds, dst + (size_t)c * ldd + r, ldd);
+                        continue;
+                    }
+                    for (int rr = r; rr < r + 8 && rr < r_end; rr++) {
+                        for (int cc = c; cc < c + 8 && cc < c_end; cc++) {
+                            dst[(size_t)cc * ldd + rr] = src[(size_t)rr * lds + cc];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// dst has to be m->cols x m->rows with the same depth, any shape, either can be a view
+void transpose(Matrix *m, Matrix *dst) {
+    if (dst->depth != m->depth || dst->rows != m->cols || dst->cols != m->rows) {
+        fprintf(stderr, "Transpose shape mismatch: %dx%d -> %dx%d\n", m->rows, m->cols, dst->rows, dst->cols);
+        exit(1);
+    }
+    for (int d = 0; d < m->depth; d++) {
+        transpose_block(m->data + strided_index(m, d, 0, 0), m->stride,
+                        dst->data + strided_index(dst, d, 0, 0), dst->stride, m->rows, m->cols);
+    }
+}
+
+// square n x n in place: tile (i, j) and tile (j, i) trade places through one 8x8 buffer,
+// the strip past the last full tile is swapped element by element
+void transpose_square_inplace(float *a, int n, int ld) {
+    float tmp[64];
+    int n8 = n & ~7;
+    for (int i = 0; i < n8; i += 8) {
+        for (int j = i; j < n8; j += 8) {
+            float *upper = a + (size_t)i * ld + j;
+            float *lower = a + (size_t)j * ld + i;
+            transpose_8x8(upper, ld, tmp, 8);
+            if (j != i) {
+                transpose_8x8(lower, ld, upper, ld);
+            }
+            for (int r = 0; r < 8; r++) {
+                memcpy(lower + r * ld, tmp + r * 8, 8 * sizeof(float));
+            }
+        }
+    }
+    for (int r = n8; r < n; r++) {
+        for (int c = 0; c < r; c++) {
+            float temp = a[(size_t)r * ld + c];
+            a[(size_t)r * ld + c] = a[(size_t)c * ld + r];
+            a[(size_t)c * ld + r] = temp;
+        }
+    }
+}
+
+// rows x cols stored contiguously becomes cols x rows in the same memory: element i = r * cols + c
+// belongs at c * rows + r = i * rows mod (n - 1), so each cycle of that permutation is followed
+// once, carrying one float along (one bit per element remembers which positions are done)
+void transpose_cycles(float *a, int rows, int cols) {
+    size_t n = (size_t)rows * cols;
+    if (rows == 1 || cols == 1) {
+        return;
+    }
+    unsigned char *done = (unsigned char *)calloc((n + 7) / 8, 1);
+    if (done == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    // the first and last element never move
+    for (size_t start = 1; start < n - 1; start++) {
+        if (done[start / 8] & (1 << (start % 8))) {
+            continue;
+        }
+        size_t i = start;
+        float carry = a[i];
+        do {
+            size_t next = i * rows % (n - 1);
+            float temp = a[next];
+            a[next] = carry;
+            carry = temp;
+            done[i / 8] |= 1 << (i % 8);
+            i = next;
+        } while (i != start);
+    }
+    free(done);
+}
+
+// square matrices (views too) are transposed tile by tile, non-square ones have to be contiguous
+// (stride == cols) and come out as cols x rows, every slice the same way
+void transpose_inplace(Matrix *m) {
+    if (m->rows == m->cols) {
+        for (int d = 0; d < m->depth; d++) {
+            transpose_square_inplace(m->data + strided_index(m, d, 0, 0), m->rows, m->stride);
+        }
+        return;
+    }
+    if (m->stride != m->cols) {
+        fprintf(stderr, "transpose_inplace needs a square or contiguous matrix\n");
+        exit(1);
+    }
+    for (int d = 0; d < m->depth; d++) {
+        transpose_cycles(m->data + (size_t)d * m->rows * m->cols, m->rows, m->cols);
+    }
+    int rows = m->rows;
+    m->rows = m->cols;
+    m->cols = rows;
+    m->stride = rows;
+}
+
+void print_matrix(Matrix *m) {
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            for (int c = 0; c < m->cols; c++) {
+                printf("%f ", get(m, d, r, c));
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+}
+
+void matmul(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < a->depth; d++) {
+        for (int r = 0; r < a->rows; r++) {
+            for (int c = 0; c < b->cols; c++) {
+                
+                float temp = 0.0f;
+                for (int i = 0; i < a->cols; i++) {
+                    temp += get(a, d, r, i) * get(b, d, i, c);
+                }
+                // printf("temp: %f\n", temp);
+                set(res, d, r, c, temp);
+
+            }
+        }
+    }
+}
+
+// b^T (N x K) in a scratch matrix, for the kernels that read B's columns as rows
+// b can be any shape, padded or a view, and is left alone, free_matrix the copy
+void transpose_copy(Matrix *b, Matrix *bt) {
+    allocate_matrix_zeros(bt, b->depth, b->cols, b->rows);
+    transpose(b, bt);
+}
+
+// b is transposed into scratch (K x N becomes N x K) so the inner loop reads both operands row-wise
+void matmul_transpose(Matrix *a, Matrix *b, Matrix *res) {
+    Matrix bt;
+    transpose_copy(b, &bt);
+    for (int d = 0; d < a->depth; d++) {
+        for (int r = 0; r < a->rows; r++) {
+            const float *a_row = a->data + strided_index(a, d, r, 0);
+            for (int c = 0; c < bt.rows; c++) {
+                const float *b_row = bt.data + strided_index(&bt, d, c, 0);
+                float temp = 0.0f;
+                for (int i = 0; i < a->cols; i++) {
+                    temp += a_row[i] * b_row[i];
+                }
+                res->data[strided_index(res, d, r, c)] = temp;
+            }
+        }
+    }
+    free_matrix(&bt);
+}
+
+void zero_matrix(Matrix *m) {
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            memset(m->data + strided_index(m, d, r, 0), 0, m->cols * sizeof(float));
+        }
+    }
+}
+
+// element-wise res = a (op) b for matching shapes, any of them can be a view
+// these back +, - and * in the Python binding (matrix.py), rows are contiguous so the inner loops vectorize
+void add(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < res->depth; d++) {
+        for (int r = 0; r < res->rows; r++) {
+            const float *x = a->data + ((size_t)d * a->rows + r) * a->stride;
+            const float *y = b->data + ((size_t)d * b->rows + r) * b->stride;
+            float *z = res->data + ((size_t)d * res->rows + r) * res->stride;
+            for (int c = 0; c < res->cols; c++) {
+                z[c] = x[c] + y[c];
+            }
+        }
+    }
+}
+
+void sub(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < res->depth; d++) {
+        for (int r = 0; r < res->rows; r++) {
+            const float *x = a->data + ((size_t)d * a->rows + r) * a->stride;
+            const float *y = b->data + ((size_t)d * b->rows + r) * b->stride;
+            float *z = res->data + ((size_t)d * res->rows + r) * res->stride;
+            for (int c = 0; c < res->cols; c++) {
+                z[c] = x[c] - y[c];
+            }
+        }
+    }
+}
+
+void mul(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < res->depth; d++) {
+        for (int r = 0; r < res->rows; r++) {
+            const float *x = a->data + ((size_t)d * a->rows + r) * a->stride;
+            const float *y = b->data + ((size_t)d * b->rows + r) * b->stride;
+            float *z = res->data + ((size_t)d * res->rows + r) * res->stride;
+            for (int c = 0; c < res->cols; c++) {
+                z[c] = x[c] * y[c];
+            }
+        }
+    }
+}
+
+// per-machine tuning profile, block sizes and thread count that won the sweep in autotune()
+// the defaults are what the Goto/BLIS numbers give for a ~32K L1 / ~1M L2 part, the file overrides them
+typedef struct {
+    int mc;
+    int kc;
+    int nc;
+    int tile_size;
+    int num_threads;    // 0 means one per online core
+} Tuning;
+
+Tuning tuning = {72, 256, 4080, 32, 0};
+
+// MATRIX_TUNING_FILE overrides where the profile lives
+const char *tuning_path(void) {
+    const char *env = getenv("MATRIX_TUNING_FILE");
+    return env != NULL && env[0] != '\0' ? env : "matrix_tuning.txt";
+}
+
+// the profile is only valid on the cpu it was measured on, home directories are shared between nodes
+void cpu_model(char *buf, int size) {
+    snprintf(buf, size, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            snprintf(buf, size, "%s", colon + 2);
+            buf[strcspn(buf, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(f);
+}
+
+// key=value per line, unknown keys are skipped (strassens.c keeps its crossover in the same file)
+__attribute__((constructor))
+void load_tuning(void) {
+    FILE *f = fopen(tuning_path(), "r");
+    if (f == NULL) {
+        return;
+    }
+    char cpu[128], line[256];
+    cpu_model(cpu, sizeof(cpu));
+    Tuning t = tuning;
+    int valid = 1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *eq = strchr(line, '=');
+        if (eq == NULL) {
+            continue;
+        }
+        *eq = '\0';
+        char *value = eq + 1;
+        value[strcspn(value, "\n")] = '\0';
+        if (strcmp(line, "cpu") == 0) {
+            valid = strcmp(value, cpu) == 0;
+        } else if (strcmp(line, "mc") == 0) {
+            t.mc = atoi(value);
+        } else if (strcmp(line, "kc") == 0) {
+            t.kc = atoi(value);
+        } else if (strcmp(line, "nc") == 0) {
+            t.nc = atoi(value);
+        } else if (strcmp(line, "tile_size") == 0) {
+            t.tile_size = atoi(value);
+        } else if (strcmp(line, "threads") == 0) {
+            t.num_threads = atoi(value);
+        }
+    }
+    fclose(f);
+    if (!valid) {
+        fprintf(stderr, "%s was tuned on another cpu, using the defaults\n", tuning_path());
+        return;
+    }
+    if (t.mc > 0 && t.kc > 0 && t.nc > 0 && t.tile_size > 0 && t.num_threads >= 0) {
+        tuning = t;
+    }
+}
+
+// rewrites our keys and keeps the lines other programs own, unless the file was tuned on another cpu
+void save_tuning(void) {
+    char cpu[128];
+    cpu_model(cpu, sizeof(cpu));
+    const char *ours[] = {"cpu", "mc", "kc", "nc", "tile_size", "threads"};
+    char kept[4096] = "";
+    size_t used = 0;
+
+    FILE *f = fopen(tuning_path(), "r");
+    if (f != NULL) {
+        char line[256];
+        int same_cpu = 1;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            size_t key_len = strcspn(line, "=");
+            int owned = 0;
+            for (int i = 0; i < (int)(sizeof(ours) / sizeof(ours[0])); i++) {
+                owned |= strlen(ours[i]) == key_len && strncmp(line, ours[i], key_len) == 0;
+            }
+            if (key_len == 3 && strncmp(line, "cpu", 3) == 0) {
+                same_cpu = strncmp(line + 4, cpu, strlen(cpu)) == 0 && line[4 + strlen(cpu)] == '\n';
+            }
+            if (!owned && line[key_len] == '=' && used + strlen(line) < sizeof(kept)) {
+                strcpy(kept + used, line);
+                used += strlen(line);
+            }
+        }
+        fclose(f);
+        if (!same_cpu) {
+            kept[0] = '\0';
+        }
+    }
+
+    f = fopen(tuning_path(), "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not write %s\n", tuning_path());
+        return;
+    }
+    fprintf(f, "cpu=%s\nmc=%d\nkc=%d\nnc=%d\ntile_size=%d\nthreads=%d\n%s",
+            cpu, tuning.mc, tuning.kc, tuning.nc, tuning.tile_size, tuning.num_threads, kept);
+    fclose(f);
+}
+
+// persistent thread pool, workers are started once and then reused by every parallel kernel,
+// so a 128x128 multiply doesn't pay thread creation on each call
+// the calling thread always takes part as tid 0, workers are tid 1..num_threads-1
+#define MAX_THREADS 256
+
+typedef void (*parallel_fn)(void *arg, int tid, int nthreads);
+
+typedef struct {
+    pthread_t workers[MAX_THREADS];
+    int num_threads;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_mutex_t run_lock;
+    parallel_fn fn;
+    void *arg;
+    int active;
+    int job;
+    int first_job;
+    int pending;
+    int shutdown;
+} ThreadPool;
+
+ThreadPool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .run_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// set on workers (and on the caller while it runs a job) so nested parallel calls run serially
+__thread int in_parallel_region = 0;
+
+void cpu_relax(int spins) {
+    if (spins < 1024) {
+#ifdef MATRIX_X86
+        _mm_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+void pin_thread(pthread_t thread, int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+void *pool_worker(void *p) {
+    int tid = (int)(intptr_t)p;
+    int seen = pool.first_job;
+    in_parallel_region = 1;
+
+    for (;;) {
+        // spin for a while before sleeping, back to back multiplies then never hit the futex
+        int job;
+        int spins = 0;
+        while ((job = __atomic_load_n(&pool.job, __ATOMIC_ACQUIRE)) == seen && spins < 1 << 14) {
+            cpu_relax(spins++);
+        }
+        if (job == seen) {
+            pthread_mutex_lock(&pool.lock);
+            while ((job = __atomic_load_n(&pool.job, __ATOMIC_ACQUIRE)) == seen) {
+                pthread_cond_wait(&pool.wake, &pool.lock);
+            }
+            pthread_mutex_unlock(&pool.lock);
+        }
+        seen = job;
+
+        if (pool.shutdown) {
+            return NULL;
+        }
+        if (tid < pool.active) {
+            pool.fn(pool.arg, tid, pool.active);
+        }
+        __atomic_sub_fetch(&pool.pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void stop_thread_pool(void) {
+    if (!pool.started) {
+        return;
+    }
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    __atomic_add_fetch(&pool.job, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.num_threads; i++) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    pool.started = 0;
+    pool.shutdown = 0;
+}
+
+void start_thread_pool(int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > MAX_THREADS) {
+        num_threads = MAX_THREADS;
+    }
+    pool.num_threads = num_threads;
+    pool.first_job = pool.job;
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&pool.workers[i], NULL, pool_worker, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "Thread creation failed\n");
+            exit(1);
+        }
+        pin_thread(pool.workers[i], i);
+    }
+    __atomic_store_n(&pool.started, 1, __ATOMIC_RELEASE);
+}
+
+// MATRIX_NUM_THREADS=n overrides the tuned thread count, which overrides one thread per online core
+int default_num_threads(void) {
+    const char *env = getenv("MATRIX_NUM_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+        return atoi(env);
+    }
+    if (tuning.num_threads > 0) {
+        return tuning.num_threads;
+    }
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// run_lock keeps it from swapping the pool under a running multiply (it waits for that one to finish),
+// don't call it from inside a parallel kernel
+void set_num_threads(int num_threads) {
+    pthread_mutex_lock(&pool.run_lock);
+    stop_thread_pool();
+    start_thread_pool(num_threads);
+    pthread_mutex_unlock(&pool.run_lock);
+}
+
+// the pool starts on first use, under run_lock so two threads making their first call at once
+// (ctypes drops the GIL) don't both start one, like start_task_runtime in strassens.c
+int get_num_threads(void) {
+    if (!__atomic_load_n(&pool.started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&pool.run_lock);
+        if (!pool.started) {
+            start_thread_pool(default_num_threads());
+        }
+        pthread_mutex_unlock(&pool.run_lock);
+    }
+    return pool.num_threads;
+}
+
+// runs fn(arg, tid, nthreads) on nthreads threads and returns once all of them are done
+// nested calls, or calls while another thread owns the pool, just run serially
+void parallel_run(parallel_fn fn, void *arg, int nthreads) {
+    if (nthreads > get_num_threads()) {
+        nthreads = pool.num_threads;
+    }
+    if (nthreads <= 1 || in_parallel_region || pthread_mutex_trylock(&pool.run_lock) != 0) {
+        fn(arg, 0, 1);
+        return;
+    }
+
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.active = nthreads;
+    __atomic_store_n(&pool.pending, pool.num_threads - 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool.lock);
+    __atomic_add_fetch(&pool.job, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    in_parallel_region = 1;
+    fn(arg, 0, nthreads);
+    in_parallel_region = 0;
+
+    int spins = 0;
+    while (__atomic_load_n(&pool.pending, __ATOMIC_ACQUIRE) > 0) {
+        cpu_relax(spins++);
+    }
+    pthread_mutex_unlock(&pool.run_lock);
+}
+
+// spinning barrier for phases inside one parallel_run (pack, then compute)
+typedef struct {
+    int arrived;
+    int generation;
+} Barrier;
+
+void barrier_wait(Barrier *b, int nthreads) {
+    if (nthreads == 1) {
+        return;
+    }
+    int generation = __atomic_load_n(&b->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&b->arrived, 1, __ATOMIC_ACQ_REL) == nthreads) {
+        __atomic_store_n(&b->arrived, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&b->generation, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    int spins = 0;
+    while (__atomic_load_n(&b->generation, __ATOMIC_ACQUIRE) == generation) {
+        cpu_relax(spins++);
+    }
+}
+
+// splits [0, total) into nthreads contiguous chunks
+void thread_range(int total, int tid, int nthreads, int *start, int *end) {
+    *start = (int)((long long)total * tid / nthreads);
+    *end = (int)((long long)total * (tid + 1) / nthreads);
+}
+
+typedef struct {
+    Matrix *a;
+    Matrix *b;
+    Matrix *res;
+    int tile_size;
+} TiledArgs;
+
+// row tiles x column tiles are split across the pool, every (r, c) tile writes its own part of res
+// b is already transposed here (N x K), so its rows are the columns of res
+void matmul_transpose_tiled_thread(void *arg, int tid, int nthreads) {
+    TiledArgs *t = (TiledArgs *)arg;
+    Matrix *a = t->a;
+    Matrix *b = t->b;
+    Matrix *res = t->res;
+    int tile_size = t->tile_size;
+    int row_tiles = (a->rows + tile_size - 1) / tile_size;
+    int col_tiles = (b->rows + tile_size - 1) / tile_size;
+    int start, end;
+    thread_range(a->depth * row_tiles * col_tiles, tid, nthreads, &start, &end);
+
+    for (int unit = start; unit < end; unit++) {
+        int d = unit / (row_tiles * col_tiles);
+        int r = unit / col_tiles % row_tiles * tile_size;
+        int c = unit % col_tiles * tile_size;
+        int r_end = r + tile_size < a->rows ? r + tile_size : a->rows;
+        int c_end = c + tile_size < b->rows ? c + tile_size : b->rows;
+        for (int i = 0; i < a->cols; i += tile_size) {
+            int i_end = i + tile_size < a->cols ? i + tile_size : a->cols;
+            // 64-bit row pointers, the offsets inside the tile stay 32-bit
+            for (int rr = r; rr < r_end; rr++) {
+                const float *a_row = a->data + strided_index(a, d, rr, 0);
+                float *res_row = res->data + strided_index(res, d, rr, 0);
+                for (int cc = c; cc < c_end; cc++) {
+                    const float *b_row = b->data + strided_index(b, d, cc, 0);
+                    float sum = 0.0f;
+                    for (int ii = i; ii < i_end; ii++) {
+                        sum += a_row[ii] * b_row[ii];
+                    }
+
+                    res_row[cc] += sum;
+                }
+            }
+        }
+    }
+}
+
+// tile_size <= 0 takes the tuned one, 32 out of the box (a Ryzen 3600 L1 holds ~52x52,
+// rounded down to a power of 2), autotune() measures it instead
+// res is overwritten, like by every other kernel, b is read through a transposed scratch copy and left alone
+void matmul_transpose_tiled(Matrix *a, Matrix *b, Matrix *res, int tile_size) {
+    zero_matrix(res);
+    // an empty m or n would clamp tile_size to 0 below and divide by it, an empty k leaves res at zero
+    if (a->depth == 0 || a->rows == 0 || a->cols == 0 || b->cols == 0) {
+        return;
+    }
+
+    Matrix bt;
+    transpose_copy(b, &bt);
+
+    if (tile_size <= 0) {
+        tile_size = tuning.tile_size;
+    }
+    if (tile_size > a->rows || tile_size > bt.rows) {
+        tile_size = a->rows;
+    }
+
+    TiledArgs args = {a, &bt, res, tile_size};
+    int row_tiles = (a->rows + tile_size - 1) / tile_size;
+    int col_tiles = (bt.rows + tile_size - 1) / tile_size;
+    parallel_run(matmul_transpose_tiled_thread, &args, a->depth * row_tiles * col_tiles);
+    free_matrix(&bt);
+}
+
+// half precision storage: fp16 (IEEE binary16) or bf16 (the top half of an fp32), 2 bytes per element,
+// gemms convert to fp32 while packing and accumulate in fp32, so only the bytes moved shrink
+typedef enum {
+    FORMAT_FP32,
+    FORMAT_FP16,
+    FORMAT_BF16,
+} StorageFormat;
+
+typedef struct {
+    int depth;
+    int rows;
+    int cols;
+    int stride;
+    size_t length;
+    StorageFormat format;   // FORMAT_FP16 or FORMAT_BF16
+    uint16_t *data;
+} HalfMatrix;
+
+void allocate_half_matrix(HalfMatrix *m, StorageFormat format, int depth, int rows, int cols) {
+    size_t bytes = checked_bytes(depth, rows, cols, sizeof(uint16_t));
+    m->depth = depth;
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = cols;
+    m->length = bytes / sizeof(uint16_t);
+    m->format = format;
+    m->data = (uint16_t *)calloc(m->length, sizeof(uint16_t));
+    if (m->data == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+}
+
+void free_half_matrix(HalfMatrix *m) {
+    free(m->data);
+}
+
+float fp16_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (mant << 13) | (mant ? 0x400000 : 0);   // inf, nan (quieted, like F16C)
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant == 0) {
+        bits = sign;
+    } else {
+        // subnormal, shift the leading 1 up to the implicit bit
+        exp = 113;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// round to nearest even, like the F16C instruction
+uint16_t float_to_fp16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t abs = x & 0x7fffffff;
+    if (abs >= 0x7f800000) {
+        return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+    }
+    if (abs >= 0x477ff000) {
+        return sign | 0x7c00;                       // 65520 and up round to inf
+    }
+    if (abs < 0x38800000) {
+        // below 2^-14 the result is subnormal: round(value * 2^24)
+        if (abs < 0x33000000) {
+            return sign;
+        }
+        uint32_t mant = (abs & 0x7fffff) | 0x800000;
+        int shift = 126 - (int)(abs >> 23);
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1))) {
+            h++;
+        }
+        return sign | h;
+    }
+    // rebias the exponent, a carry out of the mantissa correctly bumps it
+    abs -= 112u << 23;
+    abs += 0xfff + ((abs >> 13) & 1);
+    return sign | (abs >> 13);
+}
+
+float bf16_to_float(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// round to nearest even, nans stay (quiet) nans
+uint16_t float_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        return (x >> 16) | 0x40;
+    }
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+// n elements between fp32 and one of the half formats, F16C/AVX2 versions are picked in select_kernels()
+typedef void (*half_to_float_fn)(const uint16_t *src, float *dst, int n);
+typedef void (*float_to_half_fn)(const float *src, uint16_t *dst, int n);
+
+void fp16_to_float_generic(const uint16_t *src, float *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = fp16_to_float(src[i]);
+    }
+}
+
+void float_to_fp16_generic(const float *src, uint16_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = float_to_fp16(src[i]);
+    }
+}
+
+void bf16_to_float_generic(const uint16_t *src, float *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = bf16_to_float(src[i]);
+    }
+}
+
+void float_to_bf16_generic(const float *src, uint16_t *dst, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = float_to_bf16(src[i]);
+    }
+}
+
+#ifdef MATRIX_X86
+__attribute__((target("avx,f16c")))
+void fp16_to_float_f16c(const uint16_t *src, float *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+    }
+    fp16_to_float_generic(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+void float_to_fp16_f16c(const float *src, uint16_t *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    float_to_fp16_generic(src + i, dst + i, n - i);
+}
+
+// widening to 32 bits and shifting up is the whole conversion
+__attribute__((target("avx2")))
+void bf16_to_float_avx2(const uint16_t *src, float *dst, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+    }
+    bf16_to_float_generic(src + i, dst + i, n - i);
+}
+#endif
+
+half_to_float_fn fp16_to_float_n = fp16_to_float_generic;
+float_to_half_fn float_to_fp16_n = float_to_fp16_generic;
+half_to_float_fn bf16_to_float_n = bf16_to_float_generic;
+float_to_half_fn float_to_bf16_n = float_to_bf16_generic;
+
+void half_to_float_n(StorageFormat format, const uint16_t *src, float *dst, int n) {
+    if (format == FORMAT_FP16) {
+        fp16_to_float_n(src, dst, n);
+    } else {
+        bf16_to_float_n(src, dst, n);
+    }
+}
+
+float half_to_float(StorageFormat format, uint16_t h) {
+    return format == FORMAT_FP16 ? fp16_to_float(h) : bf16_to_float(h);
+}
+
+// dst must have m's shape, the format is dst's, either can be a view
+void to_half(Matrix *m, HalfMatrix *dst) {
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            const float *src = m->data + ((size_t)d * m->rows + r) * m->stride;
+            uint16_t *out = dst->data + ((size_t)d * dst->rows + r) * dst->stride;
+            if (dst->format == FORMAT_FP16) {
+                float_to_fp16_n(src, out, m->cols);
+            } else {
+                float_to_bf16_n(src, out, m->cols);
+            }
+        }
+    }
+}
+
+void from_half(HalfMatrix *m, Matrix *dst) {
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            half_to_float_n(m->format, m->data + ((size_t)d * m->rows + r) * m->stride,
+                            dst->data + ((size_t)d * dst->rows + r) * dst->stride, m->cols);
+        }
+    }
+}
+
+// fp16 <-> bf16 (or a copy), through fp32 a row at a time
+void convert_half(HalfMatrix *m, HalfMatrix *dst) {
+    float *row = (float *)malloc(m->cols * sizeof(float) + 1);
+    if (row == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            half_to_float_n(m->format, m->data + ((size_t)d * m->rows + r) * m->stride, row, m->cols);
+            uint16_t *out = dst->data + ((size_t)d * dst->rows + r) * dst->stride;
+            if (dst->format == FORMAT_FP16) {
+                float_to_fp16_n(row, out, m->cols);
+            } else {
+                float_to_bf16_n(row, out, m->cols);
+            }
+        }
+    }
+    free(row);
+}
+
+// .npy files, NumPy's own format (np.save / np.load), so baseline_numpy.py and this file share matrices:
+// "\x93NUMPY", a version byte pair, the header length, then an ASCII dict header padded with spaces to a
+// multiple of 64 bytes, then the raw C order data
+// (n), (rows, cols) and (depth, rows, cols) shapes come back as 1 x 1 x n, 1 x rows x cols and depth x rows x cols
+// both assume a little-endian host and return 0, or -1 after printing why
+int save_npy(const char *path, Matrix *m) {
+    char header[256];
+    int len;
+    if (m->depth == 1) {
+        len = snprintf(header, sizeof(header), "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d), }",
+                       m->rows, m->cols);
+    } else {
+        len = snprintf(header, sizeof(header), "{'descr': '<f4', 'fortran_order': False, 'shape': (%d, %d, %d), }",
+                       m->depth, m->rows, m->cols);
+    }
+    // the 10 byte preamble + header + '\n' is padded to 64 bytes, so the data is aligned for any load
+    int header_len = (10 + len + 1 + 63) / 64 * 64 - 10;
+    memset(header + len, ' ', header_len - len - 1);
+    header[header_len - 1] = '\n';
+    unsigned char preamble[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+                                  (unsigned char)(header_len & 0xff), (unsigned char)(header_len >> 8)};
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open %s for writing\n", path);
+        return -1;
+    }
+    int ok = fwrite(preamble, 1, sizeof(preamble), f) == sizeof(preamble)
+          && fwrite(header, 1, header_len, f) == (size_t)header_len;
+    if (m->stride == m->cols) {
+        ok = ok && fwrite(m->data, sizeof(float), m->length, f) == m->length;
+    } else {
+        for (int d = 0; d < m->depth && ok; d++) {
+            for (int r = 0; r < m->rows && ok; r++) {
+                ok = fwrite(m->data + strided_index(m, d, r, 0), sizeof(float), m->cols, f) == (size_t)m->cols;
+            }
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Writing %s failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// value of 'key' in the header dict, NULL if it's missing
+const char *npy_field(const char *header, const char *key) {
+    const char *p = strstr(header, key);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(key);
+    while (*p == ' ' || *p == ':') {
+        p++;
+    }
+    return p;
+}
+
+// '<f4' data isn't read at all: the file is mapped and the Matrix points straight into it, so pages come in
+// as the kernels first touch them (and stay in the page cache between runs), a multi-GB weight file costs
+// an open and an mmap up front
+// the mapping is private, writes to the Matrix stay in memory and never reach the file, free_matrix unmaps it
+// '<f8' and '<f2' are converted into a freshly allocated Matrix, anything else (big-endian, fortran_order,
+// integer types, more than 3 dimensions) is refused
+int load_npy(const char *path, Matrix *m) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 10) {
+        fprintf(stderr, "%s is not a .npy file\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t file_bytes = (size_t)st.st_size;
+    unsigned char *base = (unsigned char *)mmap(NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", path);
+        return -1;
+    }
+
+    // version 1 has a 2 byte header length, 2 and 3 (utf-8 header) a 4 byte one
+    size_t offset = 0;
+    size_t header_len = 0;
+    if (memcmp(base, "\x93NUMPY", 6) == 0) {
+        if (base[6] == 1) {
+            offset = 10;
+            header_len = base[8] | (size_t)base[9] << 8;
+        } else if ((base[6] == 2 || base[6] == 3) && file_bytes >= 12) {
+            offset = 12;
+            header_len = base[8] | (size_t)base[9] << 8 | (size_t)base[10] << 16 | (size_t)base[11] << 24;
+        }
+    }
+    if (offset == 0 || header_len > file_bytes - offset) {
+        fprintf(stderr, "%s is not a .npy file\n", path);
+        munmap(base, file_bytes);
+        return -1;
+    }
+    char *header = (char *)malloc(header_len + 1);
+    if (header == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(header, base + offset, header_len);
+    header[header_len] = '\0';
+    size_t data_offset = offset + header_len;
+
+    const char *descr = npy_field(header, "'descr'");
+    const char *order = npy_field(header, "'fortran_order'");
+    const char *shape = npy_field(header, "'shape'");
+    size_t elem_size = 0;
+    if (descr != NULL) {
+        if (strncmp(descr, "'<f4'", 5) == 0) {
+            elem_size = 4;
+        } else if (strncmp(descr, "'<f8'", 5) == 0) {
+            elem_size = 8;
+        } else if (strncmp(descr, "'<f2'", 5) == 0) {
+            elem_size = 2;
+        }
+    }
+    long dims[3];
+    int ndim = 0;
+    int shape_ok = shape != NULL && *shape == '(';
+    if (shape_ok) {
+        const char *p = shape + 1;
+        while (1) {
+            while (*p == ' ' || *p == ',') {
+                p++;
+            }
+            if (*p == ')') {
+                break;
+            }
+            char *end;
+            long dim = strtol(p, &end, 10);
+            if (end == p || dim < 0 || dim > INT_MAX || ndim == 3) {
+                shape_ok = 0;
+                break;
+            }
+            dims[ndim++] = dim;
+            p = end;
+        }
+    }
+    int fortran = order == NULL || strncmp(order, "False", 5) != 0;
+    free(header);
+    if (elem_size == 0 || fortran || !shape_ok) {
+        fprintf(stderr, "%s: only C order little-endian float32/float64/float16 with up to 3 dimensions is supported\n", path);
+        munmap(base, file_bytes);
+        return -1;
+    }
+
+    int depth = ndim == 3 ? (int)dims[0] : 1;
+    int rows = ndim >= 2 ? (int)dims[ndim - 2] : 1;
+    int cols = ndim >= 1 ? (int)dims[ndim - 1] : 1;
+    size_t data_bytes = checked_bytes(depth, rows, cols, elem_size);
+    if (data_bytes > file_bytes - data_offset) {
+        fprintf(stderr, "%s is truncated\n", path);
+        munmap(base, file_bytes);
+        return -1;
+    }
+
+    if (elem_size == sizeof(float) && data_offset % sizeof(float) == 0) {
+        // whole pages past the data (nothing np.save writes, but cheap to drop) go back right away
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t keep = (data_offset + data_bytes + page - 1) / page * page;
+        if (file_bytes > keep) {
+            munmap(base + keep, file_bytes - keep);
+        }
+        m->depth = depth;
+        m->rows = rows;
+        m->cols = cols;
+        m->stride = cols;
+        m->length = data_bytes / sizeof(float);
+        m->data = (float *)(base + data_offset);
+        m->alloc = ALLOC_FILE;
+        m->alloc_bytes = data_offset + data_bytes;
+        return 0;
+    }
+
+    // the one copy: widen or narrow into a normal matrix (memcpy, the data may be unaligned)
+    allocate_matrix_zeros(m, depth, rows, cols);
+    const unsigned char *src = base + data_offset;
+    for (int d = 0; d < depth; d++) {
+        for (int r = 0; r < rows; r++) {
+            float *dst = m->data + strided_index(m, d, r, 0);
+            for (int c = 0; c < cols; c++, src += elem_size) {
+                if (elem_size == 8) {
+                    double v;
+                    memcpy(&v, src, sizeof(v));
+                    dst[c] = (float)v;
+                } else if (elem_size == 2) {
+                    uint16_t h;
+                    memcpy(&h, src, sizeof(h));
+                    dst[c] = fp16_to_float(h);
+                } else {
+                    memcpy(dst + c, src, sizeof(float));
+                }
+            }
+        }
+    }
+    munmap(base, file_bytes);
+    return 0;
+}
+
+// Goto/BLIS style blocked gemm (see the Goto paper in the README), five loops around a microkernel:
+// a KC x NC panel of B is packed to live in L3, an MC x KC block of A is packed to live in L2,
+// and each KC x NR micro-panel of B streams through L1 while an MR x NR block of C sits in registers
+// MR and NR are fixed by the microkernels, MC, KC and NC come from the tuning profile
+#define MR 6
+#define NR 16
+
+int min_int(int a, int b) {
+    return a < b ? a : b;
+}
+
+int round_up(int x, int multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+// for buffer sizes, which outgrow an int long before the dimensions they come from do
+size_t round_up_size(size_t x, size_t multiple) {
+    return (x + multiple - 1) / multiple * multiple;
+}
+
+// packs an mc x kc block of A into MR-row micro-panels, each stored k-major ([k][MR]),
+// rows past mc are zero padded so the microkernel never has to check bounds
+// rsa/csa are the row and column strides of A, so a transposed A is just swapped strides
+// alpha is folded in here, the kernel then never has to scale anything
+void pack_a(int mc, int kc, float alpha, const float *a, int rsa, int csa, float *packed) {
+    for (int i = 0; i < mc; i += MR) {
+        int rows = min_int(MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            for (int ii = 0; ii < rows; ii++) {
+                packed[ii] = alpha * a[(size_t)(i + ii) * rsa + (size_t)p * csa];
+            }
+            for (int ii = rows; ii < MR; ii++) {
+                packed[ii] = 0.0f;
+            }
+            packed += MR;
+        }
+    }
+}
+
+// packs a kc x nc panel of B into NR-column micro-panels, each stored k-major ([k][NR])
+void pack_b(int kc, int nc, const float *b, int rsb, int csb, float *packed) {
+    for (int j = 0; j < nc; j += NR) {
+        int cols = min_int(NR, nc - j);
+        for (int p = 0; p < kc; p++) {
+            for (int jj = 0; jj < cols; jj++) {
+                packed[jj] = b[(size_t)p * rsb + (size_t)(j + jj) * csb];
+            }
+            for (int jj = cols; jj < NR; jj++) {
+                packed[jj] = 0.0f;
+            }
+            packed += NR;
+        }
+    }
+}
+
+// pack_a and pack_b for half storage, the conversion to fp32 happens on the way into the packed buffer
+void pack_a_half(int mc, int kc, float alpha, StorageFormat format, const uint16_t *a, int rsa, int csa, float *packed) {
+    for (int i = 0; i < mc; i += MR) {
+        int rows = min_int(MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            for (int ii = 0; ii < rows; ii++) {
+                packed[ii] = alpha * half_to_float(format, a[(size_t)(i + ii) * rsa + (size_t)p * csa]);
+            }
+            for (int ii = rows; ii < MR; ii++) {
+                packed[ii] = 0.0f;
+            }
+            packed += MR;
+        }
+    }
+}
+
+// rows of B that are contiguous (csb == 1) go through the vector converters NR at a time
+void pack_b_half(int kc, int nc, StorageFormat format, const uint16_t *b, int rsb, int csb, float *packed) {
+    for (int j = 0; j < nc; j += NR) {
+        int cols = min_int(NR, nc - j);
+        for (int p = 0; p < kc; p++) {
+            if (csb == 1) {
+                half_to_float_n(format, b + (size_t)p * rsb + j, packed, cols);
+            } else {
+                for (int jj = 0; jj < cols; jj++) {
+                    packed[jj] = half_to_float(format, b[(size_t)p * rsb + (size_t)(j + jj) * csb]);
+                }
+            }
+            for (int jj = cols; jj < NR; jj++) {
+                packed[jj] = 0.0f;
+            }
+            packed += NR;
+        }
+    }
+}
+
+// optional epilogue, applied by the microkernel to the finished C tile before it's stored, so bias,
+// activation and clamp don't cost another pass over the output:
+// C = clamp(activation(scale * (alpha * A * B + beta * C) + row_bias[i] + col_bias[j]))
+typedef enum {
+    ACTIVATION_NONE,
+    ACTIVATION_RELU,
+    ACTIVATION_GELU,    // tanh approximation, x * sigmoid(1.5958 * (x + 0.044715 * x^3))
+} Activation;
+
+typedef struct {
+    float scale;
+    const float *row_bias;  // m floats or NULL
+    const float *col_bias;  // n floats or NULL
+    Activation activation;
+    int clamp;
+    float clamp_min;
+    float clamp_max;
+} GemmEpilogue;
+
+// scale 1, no bias, no activation, no clamp, set the fields you need on top
+void gemm_epilogue_init(GemmEpilogue *ep) {
+    ep->scale = 1.0f;
+    ep->row_bias = NULL;
+    ep->col_bias = NULL;
+    ep->activation = ACTIVATION_NONE;
+    ep->clamp = 0;
+    ep->clamp_min = 0.0f;
+    ep->clamp_max = 0.0f;
+}
+
+// Cephes style exp: 2^n * e^r with |r| <= ln2 / 2 and a degree 6 polynomial for e^r,
+// kernel_avx2 runs the same steps 8 wide, so both kernels agree and nothing needs libm
+float exp_approx(float x) {
+    x = x > 88.0f ? 88.0f : (x < -88.0f ? -88.0f : x);
+    float fn = x * 1.44269504088896341f;
+    int n = (int)(fn + (fn >= 0.0f ? 0.5f : -0.5f));
+    float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    union { int i; float f; } scale = {(n + 127) << 23};
+    return p * scale.f;
+}
+
+float gelu(float x) {
+    return x / (1.0f + exp_approx(-1.5957691216f * (x + 0.044715f * x * x * x)));
+}
+
+float epilogue_apply(const GemmEpilogue *ep, float v, int row, int col) {
+    v *= ep->scale;
+    if (ep->row_bias != NULL) {
+        v += ep->row_bias[row];
+    }
+    if (ep->col_bias != NULL) {
+        v += ep->col_bias[col];
+    }
+    if (ep->activation == ACTIVATION_RELU) {
+        v = v > 0.0f ? v : 0.0f;
+    } else if (ep->activation == ACTIVATION_GELU) {
+        v = gelu(v);
+    }
+    if (ep->clamp) {
+        v = v < ep->clamp_min ? ep->clamp_min : (v > ep->clamp_max ? ep->clamp_max : v);
+    }
+    return v;
+}
+
+// 4-wide float vector, GCC/clang vector extensions lower this to SSE on x86 and NEON on M series
+typedef float float4 __attribute__((vector_size(16)));
+
+// computes an MR x NR block of C from packed micro-panels, only the top-left m x n part is written back
+// C = beta * C + A * B, beta == 0 overwrites C without reading it (first KC block of a beta == 0 gemm),
+// so C never needs a separate zeroing pass, later KC blocks pass beta == 1
+// ep is only passed on the last KC block, row0/col0 locate the tile in C for the bias vectors
+// plain triple loops over a float acc[MR][NR] don't get kept in registers, hence the vector types
+void kernel_generic(int kc, const float *a, const float *b, float *c, int rsc, int m, int n, float beta,
+                    const GemmEpilogue *ep, int row0, int col0) {
+    float4 acc[MR][NR / 4] = {{{0}}};
+
+    for (int p = 0; p < kc; p++) {
+        float4 bv[NR / 4];
+        for (int j = 0; j < NR / 4; j++) {
+            __builtin_memcpy(&bv[j], b + j * 4, sizeof(float4));
+        }
+        for (int i = 0; i < MR; i++) {
+            float4 ai = {a[i], a[i], a[i], a[i]};
+            for (int j = 0; j < NR / 4; j++) {
+                acc[i][j] += ai * bv[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+
+    float *tile = (float *)acc;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++) {
+            float v = beta == 0.0f ? tile[i * NR + j] : beta * c[(size_t)i * rsc + j] + tile[i * NR + j];
+            c[(size_t)i * rsc + j] = ep == NULL ? v : epilogue_apply(ep, v, row0 + i, col0 + j);
+        }
+    }
+}
+
+#ifdef MATRIX_X86
+// exp_approx, 8 wide
+__attribute__((target("avx2,fma")))
+static inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-88.0f)), _mm256_set1_ps(88.0f));
+    __m256 fn = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(fn, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fmadd_ps(fn, _mm256_set1_ps(2.12194440e-4f), r);
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+    __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fn), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(n));
+}
+
+// epilogue_apply on 8 columns of one row, col_bias is already loaded (zero without one)
+__attribute__((target("avx2,fma")))
+static inline __m256 epilogue_avx2(const GemmEpilogue *ep, __m256 v, __m256 col_bias, int row) {
+    v = _mm256_fmadd_ps(_mm256_set1_ps(ep->scale), v, col_bias);
+    if (ep->row_bias != NULL) {
+        v = _mm256_add_ps(v, _mm256_set1_ps(ep->row_bias[row]));
+    }
+    if (ep->activation == ACTIVATION_RELU) {
+        v = _mm256_max_ps(v, _mm256_setzero_ps());
+    } else if (ep->activation == ACTIVATION_GELU) {
+        __m256 z = _mm256_mul_ps(_mm256_mul_ps(v, v), _mm256_mul_ps(v, _mm256_set1_ps(0.044715f)));
+        z = _mm256_mul_ps(_mm256_add_ps(v, z), _mm256_set1_ps(-1.5957691216f));
+        v = _mm256_div_ps(v, _mm256_add_ps(_mm256_set1_ps(1.0f), exp_avx2(z)));
+    }
+    if (ep->clamp) {
+        v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(ep->clamp_min)), _mm256_set1_ps(ep->clamp_max));
+    }
+    return v;
+}
+
+// same contract as kernel_generic, 6x16 block of C held in 12 ymm accumulators,
+// each k step is two aligned loads of B, six broadcasts of A and twelve fmas
+// edges (m < MR or n < NR) are written back with masked loads/stores
+__attribute__((target("avx2,fma")))
+void kernel_avx2(int kc, const float *a, const float *b, float *c, int rsc, int m, int n, float beta,
+                 const GemmEpilogue *ep, int row0, int col0) {
+    // named accumulators, an __m256 acc[MR][2] indexed in the write-back gets spilled to the stack every k step
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        ai = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(ai, b0, c00);
+        c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10);
+        c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20);
+        c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30);
+        c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ai, b0, c40);
+        c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ai, b0, c50);
+        c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += MR;
+        b += NR;
+    }
+
+    __m256 acc[MR][2] = {{c00, c01}, {c10, c11}, {c20, c21}, {c30, c31}, {c40, c41}, {c50, c51}};
+    __m256 beta_v = _mm256_set1_ps(beta);
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i mask0 = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lanes);
+    __m256i mask1 = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - 8), lanes);
+    __m256 bias0 = _mm256_setzero_ps(), bias1 = _mm256_setzero_ps();
+    if (ep != NULL && ep->col_bias != NULL) {
+        bias0 = _mm256_maskload_ps(ep->col_bias + col0, mask0);
+        bias1 = _mm256_maskload_ps(ep->col_bias + col0 + 8, mask1);
+    }
+
+    if (n == NR) {
+        for (int i = 0; i < m; i++) {
+            float *row = c + (size_t)i * rsc;
+            if (beta != 0.0f) {
+                acc[i][0] = _mm256_fmadd_ps(beta_v, _mm256_loadu_ps(row), acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(beta_v, _mm256_loadu_ps(row + 8), acc[i][1]);
+            }
+            if (ep != NULL) {
+                acc[i][0] = epilogue_avx2(ep, acc[i][0], bias0, row0 + i);
+                acc[i][1] = epilogue_avx2(ep, acc[i][1], bias1, row0 + i);
+            }
+            _mm256_storeu_ps(row, acc[i][0]);
+            _mm256_storeu_ps(row + 8, acc[i][1]);
+        }
+        return;
+    }
+
+    for (int i = 0; i < m; i++) {
+        float *row = c + (size_t)i * rsc;
+        if (beta != 0.0f) {
+            acc[i][0] = _mm256_fmadd_ps(beta_v, _mm256_maskload_ps(row, mask0), acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(beta_v, _mm256_maskload_ps(row + 8, mask1), acc[i][1]);
+        }
+        if (ep != NULL) {
+            acc[i][0] = epilogue_avx2(ep, acc[i][0], bias0, row0 + i);
+            acc[i][1] = epilogue_avx2(ep, acc[i][1], bias1, row0 + i);
+        }
+        _mm256_maskstore_ps(row, mask0, acc[i][0]);
+        _mm256_maskstore_ps(row + 8, mask1, acc[i][1]);
+    }
+}
+#endif
+
+// int8 microkernels: an MR x NR block of exact int32 sums from packed int8 micro-panels, written to
+// tile (MR * NR, row-major), the caller does the write-back since it differs between int32 and
+// dequantized float output and costs little next to kc multiply-adds per element
+// k is grouped so one instruction covers several k steps, how depends on the layout:
+//   S8_PAIRS  A and B sign-extended to int16, [k/2][MR][2] and [k/2][NR][2], for vpmaddwd
+//   S8_QUADS  A offset to uint8 (a + 128), [k/4][MR][4], B as int8 [k/4][NR][4] followed by NR int32
+//             column sums of the block, for vpdpbusd, the kernel takes the 128 * colsum back out
+// vpmaddubsw would do 32 multiplies per instruction on AVX2 instead of 16, but it saturates its int16
+// pair sums (255 * 127 * 2 doesn't fit), so the AVX2 kernel widens to int16 and uses vpmaddwd instead
+typedef int32_t int4v __attribute__((vector_size(16)));
+
+void kernel_s8_generic(int kc, const void *pa, const void *pb, int32_t *tile) {
+    const int16_t *a = (const int16_t *)pa;
+    const int16_t *b = (const int16_t *)pb;
+    int4v acc[MR][NR / 4] = {{{0}}};
+
+    for (int p = 0; p < kc; p += 2) {
+        int4v b0[NR / 4], b1[NR / 4];
+        for (int j = 0; j < NR / 4; j++) {
+            for (int jj = 0; jj < 4; jj++) {
+                b0[j][jj] = b[(j * 4 + jj) * 2];
+                b1[j][jj] = b[(j * 4 + jj) * 2 + 1];
+            }
+        }
+        for (int i = 0; i < MR; i++) {
+            int4v a0 = {a[2 * i], a[2 * i], a[2 * i], a[2 * i]};
+            int4v a1 = {a[2 * i + 1], a[2 * i + 1], a[2 * i + 1], a[2 * i + 1]};
+            for (int j = 0; j < NR / 4; j++) {
+                acc[i][j] += a0 * b0[j] + a1 * b1[j];
+            }
+        }
+        a += 2 * MR;
+        b += 2 * NR;
+    }
+    memcpy(tile, acc, sizeof(acc));
+}
+
+#ifdef MATRIX_X86
+// same register blocking as kernel_avx2, each k pair is two loads of B, six broadcasts of an A pair
+// and twelve vpmaddwd + vpaddd
+__attribute__((target("avx2")))
+void kernel_s8_avx2(int kc, const void *pa, const void *pb, int32_t *tile) {
+    const int16_t *a = (const int16_t *)pa;
+    const int16_t *b = (const int16_t *)pb;
+    __m256i acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_si256();
+        acc[i][1] = _mm256_setzero_si256();
+    }
+
+    for (int p = 0; p < kc; p += 2) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)b);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(b + 16));
+        for (int i = 0; i < MR; i++) {
+            int32_t pair;
+            memcpy(&pair, a + 2 * i, sizeof(pair));
+            __m256i ai = _mm256_set1_epi32(pair);
+            acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(ai, b0));
+            acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(ai, b1));
+        }
+        a += 2 * MR;
+        b += 2 * NR;
+    }
+    for (int i = 0; i < MR; i++) {
+        _mm256_storeu_si256((__m256i *)(tile + i * NR), acc[i][0]);
+        _mm256_storeu_si256((__m256i *)(tile + i * NR + 8), acc[i][1]);
+    }
+}
+
+// vpdpbusd does a 4-deep uint8 x int8 dot product into each int32 lane, exact, no int16 step
+__attribute__((target("avx2,avx512vl,avx512vnni")))
+void kernel_s8_vnni(int kc, const void *pa, const void *pb, int32_t *tile) {
+    const uint8_t *a = (const uint8_t *)pa;
+    const int8_t *b = (const int8_t *)pb;
+    __m256i acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_si256();
+        acc[i][1] = _mm256_setzero_si256();
+    }
+
+    for (int p = 0; p < kc; p += 4) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)b);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(b + 32));
+        for (int i = 0; i < MR; i++) {
+            int32_t quad;
+            memcpy(&quad, a + 4 * i, sizeof(quad));
+            __m256i ai = _mm256_set1_epi32(quad);
+            acc[i][0] = _mm256_dpbusd_epi32(acc[i][0], ai, b0);
+            acc[i][1] = _mm256_dpbusd_epi32(acc[i][1], ai, b1);
+        }
+        a += 4 * MR;
+        b += 4 * NR;
+    }
+
+    // A went in as a + 128, so every sum is 128 * (column sum of B) too high
+    __m256i sums0 = _mm256_slli_epi32(_mm256_load_si256((const __m256i *)b), 7);
+    __m256i sums1 = _mm256_slli_epi32(_mm256_load_si256((const __m256i *)(b + 32)), 7);
+    for (int i = 0; i < MR; i++) {
+        _mm256_storeu_si256((__m256i *)(tile + i * NR), _mm256_sub_epi32(acc[i][0], sums0));
+        _mm256_storeu_si256((__m256i *)(tile + i * NR + 8), _mm256_sub_epi32(acc[i][1], sums1));
+    }
+}
+
+// the same kernel with the VEX-encoded vpdpbusd, for AVX-VNNI parts without AVX-512 (Alder Lake and later
+// client cores, Zen 5 client), same S8_QUADS layout
+__attribute__((target("avx2,avxvnni")))
+void kernel_s8_avxvnni(int kc, const void *pa, const void *pb, int32_t *tile) {
+    const uint8_t *a = (const uint8_t *)pa;
+    const int8_t *b = (const int8_t *)pb;
+    __m256i acc[MR][2];
+    for (int i = 0; i < MR; i++) {
+        acc[i][0] = _mm256_setzero_si256();
+        acc[i][1] = _mm256_setzero_si256();
+    }
+
+    for (int p = 0; p < kc; p += 4) {
+        __m256i b0 = _mm256_load_si256((const __m256i *)b);
+        __m256i b1 = _mm256_load_si256((const __m256i *)(b + 32));
+        for (int i = 0; i < MR; i++) {
+            int32_t quad;
+            memcpy(&quad, a + 4 * i, sizeof(quad));
+            __m256i ai = _mm256_set1_epi32(quad);
+            acc[i][0] = _mm256_dpbusd_avx_epi32(acc[i][0], ai, b0);
+            acc[i][1] = _mm256_dpbusd_avx_epi32(acc[i][1], ai, b1);
+        }
+        a += 4 * MR;
+        b += 4 * NR;
+    }
+
+    __m256i sums0 = _mm256_slli_epi32(_mm256_load_si256((const __m256i *)b), 7);
+    __m256i sums1 = _mm256_slli_epi32(_mm256_load_si256((const __m256i *)(b + 32)), 7);
+    for (int i = 0; i < MR; i++) {
+        _mm256_storeu_si256((__m256i *)(tile + i * NR), _mm256_sub_epi32(acc[i][0], sums0));
+        _mm256_storeu_si256((__m256i *)(tile + i * NR + 8), _mm256_sub_epi32(acc[i][1], sums1));
+    }
+}
+
+// AVX-VNNI is cpuid leaf 7 subleaf 1, EAX bit 4, asked for directly since older compilers'
+// __builtin_cpu_supports doesn't know it; the OS ymm state check comes with the avx2 probe
+int cpu_has_avx_vnni(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (eax >> 4) & 1;
+}
+#endif
+
+// picked once at startup from cpuid, so one binary runs the widest kernel each box supports
+// MATRIX_KERNEL=generic forces the fallback, handy for checking results across machines
+typedef void (*gemm_kernel_fn)(int kc, const float *a, const float *b, float *c, int rsc, int m, int n, float beta,
+                               const GemmEpilogue *ep, int row0, int col0);
+
+gemm_kernel_fn gemm_kernel = kernel_generic;
+const char *gemm_kernel_name = "generic";
+
+typedef enum {
+    S8_PAIRS,
+    S8_QUADS,
+} S8Layout;
+
+typedef void (*s8_kernel_fn)(int kc, const void *a, const void *b, int32_t *tile);
+
+s8_kernel_fn s8_kernel = kernel_s8_generic;
+S8Layout s8_layout = S8_PAIRS;
+const char *s8_kernel_name = "generic";
+
+__attribute__((constructor))
+void select_kernels(void) {
+    const char *forced = getenv("MATRIX_KERNEL");
+    if (forced != NULL && strcmp(forced, "generic") == 0) {
+        return;
+    }
+#ifdef MATRIX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        gemm_kernel = kernel_avx2;
+        gemm_kernel_name = "avx2";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        s8_kernel = kernel_s8_avx2;
+        s8_kernel_name = "avx2";
+    }
+    if (__builtin_cpu_supports("avx2") && cpu_has_avx_vnni()) {
+        s8_kernel = kernel_s8_avxvnni;
+        s8_layout = S8_QUADS;
+        s8_kernel_name = "avxvnni";
+    }
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+        s8_kernel = kernel_s8_vnni;
+        s8_layout = S8_QUADS;
+        s8_kernel_name = "vnni";
+    }
+    if (__builtin_cpu_supports("avx")) {
+        transpose_8x8 = transpose_8x8_avx;
+    }
+    if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")) {
+        fp16_to_float_n = fp16_to_float_f16c;
+        float_to_fp16_n = float_to_fp16_f16c;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        bf16_to_float_n = bf16_to_float_avx2;
+    }
+#endif
+}
+
+float *allocate_packed(size_t count) {
+    // aligned_alloc wants the size to be a multiple of the alignment
+    float *p = (float *)aligned_alloc(64, round_up_size(count * sizeof(float), 64));
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+// small-gemm JIT (LIBXSMM style): for shapes that are only known at runtime but repeat a lot, AVX2/FMA
+// machine code is generated once per (m, n, k, lda, ldb, ldc) with every size, stride and edge mask
+// baked in, and cached, later calls with the same shape jump straight into it
+// alpha and beta are loaded at run time, only their kind is part of the key (alpha 1 or not, beta 0, 1
+// or other, at most 6 kernels per shape) so a per-call scale doesn't generate a kernel per value
+// A and B are read in place (no packing), C is split into 6 x 16 tiles, each tile is a k loop of two
+// B row loads, six broadcasts of A and twelve fmas, then one write-back, partial tiles use vmaskmovps
+// with the mask picked at generation time, so there's no edge logic left at run time
+// only x86-64 Linux (SysV calling convention, mmap), MATRIX_JIT=0 turns it off
+#if defined(__x86_64__) && defined(__linux__)
+#define MATRIX_JIT
+#endif
+
+#ifdef MATRIX_JIT
+
+// generated kernels are void fn(const float *a, const float *b, float *c, const float *scalars),
+// a in rdi, b in rsi, c in rdx, scalars (alpha, beta) in rcx, moved to r10 since ecx counts the k loop
+typedef void (*jit_gemm_fn)(const float *a, const float *b, float *c, const float *scalars);
+
+// what the write-back has to do with alpha and beta, the rest of the kernel doesn't depend on them
+typedef enum {
+    JIT_BETA_ZERO,      // C is overwritten, never read
+    JIT_BETA_ONE,       // C += alpha * AB
+    JIT_BETA_SCALED,    // C = beta * C + alpha * AB
+} JitBeta;
+
+// shapes up to this many multiply-adds (and with every dimension <= JIT_MAX_DIM) go through the JIT,
+// past that packing pays for itself and the blocked kernel wins
+#define JIT_MAX_MNK (64 * 64 * 64)
+#define JIT_MAX_DIM 256
+#define JIT_CACHE_SIZE 1024     // power of two, a full cache just stops adding shapes
+
+enum {
+    JIT_RDX = 2,
+    JIT_RSI = 6,
+    JIT_RDI = 7,
+    JIT_R8 = 8,
+    JIT_R9 = 9,
+    JIT_R10 = 10,
+    JIT_RIP = -1,
+};
+
+// constants appended after the code, reached with rip-relative loads
+enum {
+    JIT_CONST_MASK,     // 8 x -1 then 8 x 0, the mask for the first w lanes starts at int 8 - w
+};
+
+typedef struct {
+    uint8_t *code;
+    int size;
+    int capacity;
+    int fixups[4096];           // positions of rip-relative disp32s, constant in the top bits, <= 1 per tile
+    int fixup_count;
+} JitBuffer;
+
+void jit_byte(JitBuffer *j, uint8_t b) {
+    if (j->size == j->capacity) {
+        j->capacity *= 2;
+        j->code = (uint8_t *)realloc(j->code, j->capacity);
+        if (j->code == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    j->code[j->size++] = b;
+}
+
+void jit_u32(JitBuffer *j, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        jit_byte(j, (uint8_t)(v >> (8 * i)));
+    }
+}
+
+// modrm (+ disp) for [base + disp] or [rip + constant + disp], reg is the modrm.reg field
+// the bases used here never need a SIB byte (not rsp/r12) and never hit the rbp/r13 special case
+void jit_mem(JitBuffer *j, int reg, int base, int disp, int constant) {
+    if (base == JIT_RIP) {
+        jit_byte(j, (uint8_t)(((reg & 7) << 3) | 5));
+        j->fixups[j->fixup_count++] = (constant << 24) | j->size;
+        jit_u32(j, (uint32_t)disp);
+    } else if (disp == 0) {
+        jit_byte(j, (uint8_t)(((reg & 7) << 3) | (base & 7)));
+    } else if (disp >= -128 && disp <= 127) {
+        jit_byte(j, (uint8_t)(0x40 | ((reg & 7) << 3) | (base & 7)));
+        jit_byte(j, (uint8_t)disp);
+    } else {
+        jit_byte(j, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+        jit_u32(j, (uint32_t)disp);
+    }
+}
+
+// three byte VEX prefix + opcode, 256 bit, map 1 = 0F, 2 = 0F38, pp 0 = none, 1 = 66
+// rm >= 0 is a register operand, otherwise the operand is memory at base + disp
+void jit_vex(JitBuffer *j, int map, int pp, int opcode, int reg, int vvvv, int rm, int base, int disp, int constant) {
+    int b = rm >= 0 ? rm >> 3 : (base == JIT_RIP ? 0 : base >> 3);
+    jit_byte(j, 0xC4);
+    jit_byte(j, (uint8_t)((!(reg >> 3) << 7) | (1 << 6) | (!b << 5) | map));
+    jit_byte(j, (uint8_t)(((~vvvv & 15) << 3) | (1 << 2) | pp));
+    jit_byte(j, (uint8_t)opcode);
+    if (rm >= 0) {
+        jit_byte(j, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+    } else {
+        jit_mem(j, reg, base, disp, constant);
+    }
+}
+
+void jit_vxorps(JitBuffer *j, int dst) {
+    jit_vex(j, 1, 0, 0x57, dst, dst, dst, 0, 0, 0);
+}
+
+void jit_vmovups_load(JitBuffer *j, int dst, int base, int disp, int constant) {
+    jit_vex(j, 1, 0, 0x10, dst, 0, -1, base, disp, constant);
+}
+
+void jit_vmovups_store(JitBuffer *j, int src, int base, int disp) {
+    jit_vex(j, 1, 0, 0x11, src, 0, -1, base, disp, 0);
+}
+
+void jit_vmaskmovps_load(JitBuffer *j, int dst, int mask, int base, int disp) {
+    jit_vex(j, 2, 1, 0x2C, dst, mask, -1, base, disp, 0);
+}
+
+void jit_vmaskmovps_store(JitBuffer *j, int src, int mask, int base, int disp) {
+    jit_vex(j, 2, 1, 0x2E, src, mask, -1, base, disp, 0);
+}
+
+void jit_vbroadcastss(JitBuffer *j, int dst, int base, int disp, int constant) {
+    jit_vex(j, 2, 1, 0x18, dst, 0, -1, base, disp, constant);
+}
+
+// dst += x * y, y is a register (y >= 0) or memory at base + disp
+void jit_vfmadd231ps(JitBuffer *j, int dst, int x, int y, int base, int disp) {
+    jit_vex(j, 2, 1, 0xB8, dst, x, y, base, disp, 0);
+}
+
+void jit_vaddps(JitBuffer *j, int dst, int x, int y, int base, int disp) {
+    jit_vex(j, 1, 0, 0x58, dst, x, y, base, disp, 0);
+}
+
+void jit_vmulps(JitBuffer *j, int dst, int x, int y) {
+    jit_vex(j, 1, 0, 0x59, dst, x, y, 0, 0, 0);
+}
+
+// lea r64, [base + disp32], add r64, imm32 (REX.W forms)
+void jit_lea(JitBuffer *j, int dst, int base, int disp) {
+    jit_byte(j, (uint8_t)(0x48 | ((dst >> 3) << 2) | (base >> 3)));
+    jit_byte(j, 0x8D);
+    jit_byte(j, (uint8_t)(0x80 | ((dst & 7) << 3) | (base & 7)));
+    jit_u32(j, (uint32_t)disp);
+}
+
+void jit_add_imm(JitBuffer *j, int dst, int imm) {
+    jit_byte(j, (uint8_t)(0x48 | (dst >> 3)));
+    jit_byte(j, 0x81);
+    jit_byte(j, (uint8_t)(0xC0 | (dst & 7)));
+    jit_u32(j, (uint32_t)imm);
+}
+
+// ymm registers: acc(i, v) = 2 * i + v (0-11), B row 12-13 (12 is beta and 13 a scratch in the
+// write-back), A broadcast 14 (alpha in the write-back), edge mask 15
+// scale_alpha == 0 means alpha is 1 and the multiply is left out
+void jit_tile(JitBuffer *j, int i0, int mr, int j0, int nr, int k, int lda, int ldb, int ldc,
+              int scale_alpha, JitBeta beta) {
+    int nv = nr > 8 ? 2 : 1;
+    int width = nr - 8 * (nv - 1);
+    int masked = width < 8;
+
+    for (int i = 0; i < mr; i++) {
+        for (int v = 0; v < nv; v++) {
+            jit_vxorps(j, 2 * i + v);
+        }
+    }
+    if (masked) {
+        jit_vmovups_load(j, 15, JIT_RIP, (8 - width) * 4, JIT_CONST_MASK);
+    }
+    jit_lea(j, JIT_R8, JIT_RDI, i0 * lda * 4);
+    jit_lea(j, JIT_R9, JIT_RSI, j0 * 4);
+    jit_byte(j, 0xB9);      // mov ecx, k
+    jit_u32(j, (uint32_t)k);
+
+    int loop = j->size;
+    for (int v = 0; v < nv; v++) {
+        if (v == nv - 1 && masked) {
+            jit_vmaskmovps_load(j, 12 + v, 15, JIT_R9, v * 32);
+        } else {
+            jit_vmovups_load(j, 12 + v, JIT_R9, v * 32, 0);
+        }
+    }
+    for (int i = 0; i < mr; i++) {
+        jit_vbroadcastss(j, 14, JIT_R8, i * lda * 4, 0);
+        for (int v = 0; v < nv; v++) {
+            jit_vfmadd231ps(j, 2 * i + v, 14, 12 + v, 0, 0);
+        }
+    }
+    jit_add_imm(j, JIT_R8, 4);
+    jit_add_imm(j, JIT_R9, ldb * 4);
+    jit_byte(j, 0xFF);      // dec ecx
+    jit_byte(j, 0xC9);
+    jit_byte(j, 0x0F);      // jnz loop
+    jit_byte(j, 0x85);
+    jit_u32(j, (uint32_t)(loop - (j->size + 4)));
+
+    if (scale_alpha) {
+        jit_vbroadcastss(j, 14, JIT_R10, 0, 0);
+    }
+    if (beta == JIT_BETA_SCALED) {
+        jit_vbroadcastss(j, 12, JIT_R10, 4, 0);
+    }
+    for (int i = 0; i < mr; i++) {
+        for (int v = 0; v < nv; v++) {
+            int acc = 2 * i + v;
+            int disp = ((i0 + i) * ldc + j0 + 8 * v) * 4;
+            int edge = v == nv - 1 && masked;
+            if (scale_alpha) {
+                jit_vmulps(j, acc, acc, 14);
+            }
+            if (beta != JIT_BETA_ZERO) {
+                int src = -1;
+                if (edge) {
+                    jit_vmaskmovps_load(j, 13, 15, JIT_RDX, disp);
+                    src = 13;
+                }
+                if (beta == JIT_BETA_ONE) {
+                    jit_vaddps(j, acc, acc, src, JIT_RDX, disp);
+                } else {
+                    jit_vfmadd231ps(j, acc, 12, src, JIT_RDX, disp);
+                }
+            }
+            if (edge) {
+                jit_vmaskmovps_store(j, acc, 15, JIT_RDX, disp);
+            } else {
+                jit_vmovups_store(j, acc, JIT_RDX, disp);
+            }
+        }
+    }
+}
+
+// C (m x n, ldc) = alpha * A (m x k, lda) * B (k x n, ldb) + beta * C, JIT_BETA_ZERO never reads C
+jit_gemm_fn jit_generate(int m, int n, int k, int lda, int ldb, int ldc, int scale_alpha, JitBeta beta) {
+    JitBuffer *j = (JitBuffer *)malloc(sizeof(JitBuffer));
+    if (j == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    j->capacity = 4096;
+    j->size = 0;
+    j->fixup_count = 0;
+    j->code = (uint8_t *)malloc(j->capacity);
+    if (j->code == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+
+    jit_byte(j, 0x49);      // mov r10, rcx
+    jit_byte(j, 0x89);
+    jit_byte(j, 0xCA);
+    for (int i0 = 0; i0 < m; i0 += MR) {
+        for (int j0 = 0; j0 < n; j0 += NR) {
+            jit_tile(j, i0, min_int(MR, m - i0), j0, min_int(NR, n - j0), k, lda, ldb, ldc, scale_alpha, beta);
+        }
+    }
+    jit_byte(j, 0xC5);      // vzeroupper
+    jit_byte(j, 0xF8);
+    jit_byte(j, 0x77);
+    jit_byte(j, 0xC3);      // ret
+
+    while (j->size % 32 != 0) {
+        jit_byte(j, 0xCC);
+    }
+    int consts = j->size;
+    for (int i = 0; i < 16; i++) {
+        jit_u32(j, i < 8 ? 0xFFFFFFFFu : 0);
+    }
+    int offsets[1] = {consts};
+    for (int f = 0; f < j->fixup_count; f++) {
+        int pos = j->fixups[f] & 0xFFFFFF;
+        int constant = j->fixups[f] >> 24;
+        int32_t disp;
+        memcpy(&disp, j->code + pos, 4);
+        disp += offsets[constant] - (pos + 4);
+        memcpy(j->code + pos, &disp, 4);
+    }
+
+    // written while writable, then flipped to read + execute, never both at once
+    size_t bytes = round_up(j->size, 4096);
+    void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        free(j->code);
+        free(j);
+        return NULL;
+    }
+    memcpy(mem, j->code, j->size);
+    free(j->code);
+    free(j);
+    if (mprotect(mem, bytes, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, bytes);
+        return NULL;
+    }
+    return (jit_gemm_fn)mem;
+}
+
+// open addressing, lookups are lock free: a slot's key is written before its fn is published with
+// release, and readers only look at the key after seeing fn with acquire
+typedef struct {
+    int m, n, k, lda, ldb, ldc;
+    int scale_alpha;
+    JitBeta beta;
+    jit_gemm_fn fn;
+} JitEntry;
+
+JitEntry jit_cache[JIT_CACHE_SIZE];
+int jit_cache_count = 0;
+pthread_mutex_t jit_lock = PTHREAD_MUTEX_INITIALIZER;
+int jit_enabled = -1;
+
+int jit_key_equal(const JitEntry *e, int m, int n, int k, int lda, int ldb, int ldc, int scale_alpha, JitBeta beta) {
+    return e->m == m && e->n == n && e->k == k && e->lda == lda && e->ldb == ldb && e->ldc == ldc &&
+           e->scale_alpha == scale_alpha && e->beta == beta;
+}
+
+// the cached kernel for this shape, generated on first use, NULL if the JIT can't or shouldn't take it
+jit_gemm_fn jit_lookup(int m, int n, int k, int lda, int ldb, int ldc, int scale_alpha, JitBeta beta) {
+    int enabled = __atomic_load_n(&jit_enabled, __ATOMIC_RELAXED);
+    if (enabled < 0) {
+        const char *env = getenv("MATRIX_JIT");
+        enabled = gemm_kernel == kernel_avx2 && (env == NULL || strcmp(env, "0") != 0);
+        __atomic_store_n(&jit_enabled, enabled, __ATOMIC_RELAXED);
+    }
+    if (!enabled) {
+        return NULL;
+    }
+
+    unsigned h = (unsigned)m * 73856093u ^ (unsigned)n * 19349663u ^ (unsigned)k * 83492791u ^
+                 (unsigned)lda * 2654435761u ^ (unsigned)ldb * 40503u ^ (unsigned)ldc * 9176u ^
+                 (unsigned)(scale_alpha * 3 + beta) * 2246822519u;
+    unsigned slot = h & (JIT_CACHE_SIZE - 1);
+    for (int probe = 0; probe < JIT_CACHE_SIZE; probe++) {
+        JitEntry *e = &jit_cache[(slot + probe) & (JIT_CACHE_SIZE - 1)];
+        jit_gemm_fn fn = __atomic_load_n(&e->fn, __ATOMIC_ACQUIRE);
+        if (fn == NULL) {
+            break;
+        }
+        if (jit_key_equal(e, m, n, k, lda, ldb, ldc, scale_alpha, beta)) {
+            return fn;
+        }
+    }
+
+    pthread_mutex_lock(&jit_lock);
+    jit_gemm_fn fn = NULL;
+    for (int probe = 0; probe < JIT_CACHE_SIZE; probe++) {
+        JitEntry *e = &jit_cache[(slot + probe) & (JIT_CACHE_SIZE - 1)];
+        if (e->fn == NULL) {
+            // keep a quarter of the table free so probes stay short
+            if (jit_cache_count < JIT_CACHE_SIZE * 3 / 4) {
+                fn = jit_generate(m, n, k, lda, ldb, ldc, scale_alpha, beta);
+            }
+            if (fn != NULL) {
+                e->m = m;
+                e->n = n;
+                e->k = k;
+                e->lda = lda;
+                e->ldb = ldb;
+                e->ldc = ldc;
+                e->scale_alpha = scale_alpha;
+                e->beta = beta;
+                __atomic_store_n(&e->fn, fn, __ATOMIC_RELEASE);
+                jit_cache_count++;
+            }
+            break;
+        }
+        if (jit_key_equal(e, m, n, k, lda, ldb, ldc, scale_alpha, beta)) {
+            fn = e->fn;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&jit_lock);
+    return fn;
+}
+#endif
+
+typedef struct {
+    int m, n, k;
+    int mc, kc, nc;     // block sizes, copied from the tuning once per call
+    float alpha, beta;
+    const GemmEpilogue *ep;
+    const void *a;          // float or uint16_t, see a_format
+    StorageFormat a_format;
+    int rsa, csa;
+    const void *b;
+    StorageFormat b_format;
+    int rsb, csb;
+    float *c;
+    int rsc;
+    float *packed_a;
+    float *packed_b;
+    Barrier barrier;
+} GemmArgs;
+
+// one thread's share of the five loops, every thread walks the same jc/pc loops:
+// A and B are packed cooperatively (split by micro-panel), then the MC x NR units of C are split,
+// each thread gets a contiguous run of units so the A block it works on stays in its L2
+void gemm_packed_thread(void *arg, int tid, int nthreads) {
+    GemmArgs *g = (GemmArgs *)arg;
+    int m = g->m, n = g->n, k = g->k;
+    int MC = g->mc, KC = g->kc, NC = g->nc;
+    int start, end;
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = min_int(NC, n - jc);
+        int b_panels = (nc + NR - 1) / NR;
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = min_int(KC, k - pc);
+
+            thread_range(b_panels, tid, nthreads, &start, &end);
+            for (int j = start; j < end; j++) {
+                size_t offset = (size_t)pc * g->rsb + (size_t)(jc + j * NR) * g->csb;
+                if (g->b_format == FORMAT_FP32) {
+                    pack_b(kc, min_int(NR, nc - j * NR), (const float *)g->b + offset, g->rsb, g->csb,
+                           g->packed_b + j * NR * kc);
+                } else {
+                    pack_b_half(kc, min_int(NR, nc - j * NR), g->b_format, (const uint16_t *)g->b + offset,
+                                g->rsb, g->csb, g->packed_b + j * NR * kc);
+                }
+            }
+            thread_range((m + MR - 1) / MR, tid, nthreads, &start, &end);
+            for (int i = start; i < end; i++) {
+                size_t offset = (size_t)i * MR * g->rsa + (size_t)pc * g->csa;
+                if (g->a_format == FORMAT_FP32) {
+                    pack_a(min_int(MR, m - i * MR), kc, g->alpha, (const float *)g->a + offset, g->rsa, g->csa,
+                           g->packed_a + (size_t)i * MR * kc);
+                } else {
+                    pack_a_half(min_int(MR, m - i * MR), kc, g->alpha, g->a_format, (const uint16_t *)g->a + offset,
+                                g->rsa, g->csa, g->packed_a + (size_t)i * MR * kc);
+                }
+            }
+            barrier_wait(&g->barrier, nthreads);
+
+            int m_blocks = (m + MC - 1) / MC;
+            thread_range(m_blocks * b_panels, tid, nthreads, &start, &end);
+            for (int unit = start; unit < end; unit++) {
+                int ic = unit / b_panels * MC;
+                int jr = unit % b_panels * NR;
+                int mc = min_int(MC, m - ic);
+                for (int ir = 0; ir < mc; ir += MR) {
+                    gemm_kernel(kc, g->packed_a + (size_t)(ic + ir) * kc, g->packed_b + jr * kc,
+                                g->c + (size_t)(ic + ir) * g->rsc + jc + jr, g->rsc,
+                                min_int(MR, mc - ir), min_int(NR, nc - jr), pc > 0 ? 1.0f : g->beta,
+                                pc + kc == k ? g->ep : NULL, ic + ir, jc + jr);
+                }
+            }
+            // packed buffers get overwritten by the next pc/jc iteration
+            barrier_wait(&g->barrier, nthreads);
+        }
+    }
+}
+
+// C (m x n, row stride rsc) = alpha * A (m x k) * B (k x n) + beta * C, arbitrary sizes,
+// neither A nor B is modified, beta == 0 never reads C, ep (or NULL) is fused into the write-back
+// A and B can each be stored as fp32, fp16 or bf16, C is always fp32
+// runs on the thread pool, small problems stay on the calling thread, small fp32 shapes with
+// unit column strides go to a JIT-generated kernel instead (see jit_lookup)
+void gemm_packed_typed(int m, int n, int k, float alpha,
+                       const void *a, StorageFormat a_format, int rsa, int csa,
+                       const void *b, StorageFormat b_format, int rsb, int csb,
+                       float beta, float *c, int rsc, const GemmEpilogue *ep) {
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0 || alpha == 0.0f) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                float v = beta == 0.0f ? 0.0f : beta * c[(size_t)i * rsc + j];
+                c[(size_t)i * rsc + j] = ep == NULL ? v : epilogue_apply(ep, v, i, j);
+            }
+        }
+        return;
+    }
+
+#ifdef MATRIX_JIT
+    if (a_format == FORMAT_FP32 && b_format == FORMAT_FP32 && ep == NULL && csa == 1 && csb == 1 &&
+        (double)m * n * k <= JIT_MAX_MNK && m <= JIT_MAX_DIM && n <= JIT_MAX_DIM && k <= JIT_MAX_DIM &&
+        rsa <= 1 << 20 && rsb <= 1 << 20 && rsc <= 1 << 20) {
+        JitBeta kind = beta == 0.0f ? JIT_BETA_ZERO : beta == 1.0f ? JIT_BETA_ONE : JIT_BETA_SCALED;
+        jit_gemm_fn fn = jit_lookup(m, n, k, rsa, rsb, rsc, alpha != 1.0f, kind);
+        if (fn != NULL) {
+            float scalars[2] = {alpha, beta};
+            fn((const float *)a, (const float *)b, c, scalars);
+            return;
+        }
+    }
+#endif
+
+    int MC = tuning.mc, KC = tuning.kc, NC = tuning.nc;
+    GemmArgs g = {m, n, k, MC, KC, NC, alpha, beta, ep, a, a_format, rsa, csa, b, b_format, rsb, csb, c, rsc,
+                  NULL, NULL, {0, 0}};
+    g.packed_a = allocate_packed(round_up_size(m, MR) * min_int(k, KC));
+    g.packed_b = allocate_packed((size_t)min_int(k, KC) * round_up(min_int(n, NC), NR));
+
+    // below ~64^3 multiply-adds the fork/join costs more than it saves
+    int units = (m + MC - 1) / MC * ((min_int(n, NC) + NR - 1) / NR);
+    int nthreads = (double)m * n * k < 64.0 * 64 * 64 ? 1 : units;
+    parallel_run(gemm_packed_thread, &g, nthreads);
+
+    free(g.packed_a);
+    free(g.packed_b);
+}
+
+void gemm_packed(int m, int n, int k, float alpha,
+                 const float *a, int rsa, int csa,
+                 const float *b, int rsb, int csb,
+                 float beta, float *c, int rsc, const GemmEpilogue *ep) {
+    gemm_packed_typed(m, n, k, alpha, a, FORMAT_FP32, rsa, csa, b, FORMAT_FP32, rsb, csb, beta, c, rsc, ep);
+}
+
+// BLAS sgemm on row-major storage: C = alpha * op(A) * op(B) + beta * C, op(X) is X or X^T,
+// op(A) is m x k, op(B) is k x n, lda/ldb/ldc are row strides (at least the row length as stored)
+// a transposed operand is just read with swapped strides while packing, nothing is transposed in memory,
+// beta == 0 never reads C (it can hold garbage or NaNs), beta == 1 accumulates into it
+// ep (or NULL) adds bias/activation/clamp while the tile is still in registers, see GemmEpilogue
+// a and b point at elements of a_format/b_format (fp32, fp16 or bf16), lda/ldb count elements
+void sgemm_mixed(char trans_a, char trans_b, int m, int n, int k,
+                 float alpha, const void *a, StorageFormat a_format, int lda,
+                 const void *b, StorageFormat b_format, int ldb,
+                 float beta, float *c, int ldc, const GemmEpilogue *ep) {
+    int ta = trans_a == 'T' || trans_a == 't' || trans_a == 'C' || trans_a == 'c';
+    int tb = trans_b == 'T' || trans_b == 't' || trans_b == 'C' || trans_b == 'c';
+    const char *bad = NULL;
+    if (!ta && trans_a != 'N' && trans_a != 'n') {
+        bad = "trans_a";
+    } else if (!tb && trans_b != 'N' && trans_b != 'n') {
+        bad = "trans_b";
+    } else if (m < 0 || n < 0 || k < 0) {
+        bad = "m, n, k";
+    } else if (lda < (ta ? m : k) || lda < 1) {
+        bad = "lda";
+    } else if (ldb < (tb ? k : n) || ldb < 1) {
+        bad = "ldb";
+    } else if (ldc < n || ldc < 1) {
+        bad = "ldc";
+    }
+    if (bad != NULL) {
+        fprintf(stderr, "sgemm: illegal value for %s\n", bad);
+        exit(1);
+    }
+
+    gemm_packed_typed(m, n, k, alpha,
+                      a, a_format, ta ? 1 : lda, ta ? lda : 1,
+                      b, b_format, tb ? 1 : ldb, tb ? ldb : 1,
+                      beta, c, ldc, ep);
+}
+
+void sgemm_epilogue(char trans_a, char trans_b, int m, int n, int k,
+                    float alpha, const float *a, int lda,
+                    const float *b, int ldb,
+                    float beta, float *c, int ldc, const GemmEpilogue *ep) {
+    sgemm_mixed(trans_a, trans_b, m, n, k, alpha, a, FORMAT_FP32, lda, b, FORMAT_FP32, ldb, beta, c, ldc, ep);
+}
+
+void sgemm(char trans_a, char trans_b, int m, int n, int k,
+           float alpha, const float *a, int lda,
+           const float *b, int ldb,
+           float beta, float *c, int ldc) {
+    sgemm_epilogue(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc, NULL);
+}
+
+typedef struct {
+    Matrix *a;
+    Matrix *b;
+    Matrix *res;
+    const GemmEpilogue *ep;
+} BatchArgs;
+
+// every thread takes a contiguous run of slices and multiplies them one by one,
+// the gemm_packed calls inside see in_parallel_region and stay on their thread
+void matmul_batched_thread(void *arg, int tid, int nthreads) {
+    BatchArgs *t = (BatchArgs *)arg;
+    int start, end;
+    thread_range(t->res->depth, tid, nthreads, &start, &end);
+    for (int d = start; d < end; d++) {
+        Matrix a, b, res;
+        slice(t->a, d, &a);
+        slice(t->b, d, &b);
+        slice(t->res, d, &res);
+        sgemm_epilogue('N', 'N', a.rows, b.cols, a.cols, 1.0f, a.data, a.stride, b.data, b.stride,
+                       0.0f, res.data, res.stride, t->ep);
+    }
+}
+
+// drop-in for matmul_transpose_tiled: any M x K times K x N, b is left untouched and res is overwritten
+// a, b and res can be views, their stride is passed through as the leading dimension
+// batched over depth: a and b each have depth 1 or the depth of res, a depth-1 operand is
+// broadcast against every slice without being copied
+// many slices (or slices too small for gemm_packed to split) are spread across the pool one slice
+// per thread at a time, a few big slices run one after another with each gemm using the whole pool
+// ep (or NULL) is applied to every slice, bias vectors index rows and columns of one slice
+void matmul_packed_epilogue(Matrix *a, Matrix *b, Matrix *res, const GemmEpilogue *ep) {
+    int depth = res->depth;
+    if ((a->depth != 1 && a->depth != depth) || (b->depth != 1 && b->depth != depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a->depth, b->depth, depth);
+        exit(1);
+    }
+    if (a->cols != b->rows || res->rows != a->rows || res->cols != b->cols) {
+        fprintf(stderr, "Shape mismatch: %dx%d * %dx%d -> %dx%d\n", a->rows, a->cols, b->rows, b->cols, res->rows, res->cols);
+        exit(1);
+    }
+
+    BatchArgs args = {a, b, res, ep};
+    if (depth >= get_num_threads() || (double)a->rows * a->cols * b->cols < 64.0 * 64 * 64) {
+        parallel_run(matmul_batched_thread, &args, depth);
+        return;
+    }
+    matmul_batched_thread(&args, 0, 1);
+}
+
+void matmul_packed(Matrix *a, Matrix *b, Matrix *res) {
+    matmul_packed_epilogue(a, b, res, NULL);
+}
+
+// fp32 activations times half precision weights (the bandwidth-bound case), res is overwritten,
+// depth works like matmul_packed (b can be a single slice broadcast against every slice of a)
+void matmul_packed_half(Matrix *a, HalfMatrix *b, Matrix *res) {
+    if ((a->depth != 1 && a->depth != res->depth) || (b->depth != 1 && b->depth != res->depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a->depth, b->depth, res->depth);
+        exit(1);
+    }
+    if (a->cols != b->rows || res->rows != a->rows || res->cols != b->cols) {
+        fprintf(stderr, "Shape mismatch: %dx%d * %dx%d -> %dx%d\n", a->rows, a->cols, b->rows, b->cols, res->rows, res->cols);
+        exit(1);
+    }
+    for (int d = 0; d < res->depth; d++) {
+        Matrix a_slice, res_slice;
+        slice(a, d, &a_slice);
+        slice(res, d, &res_slice);
+        const uint16_t *b_slice = b->data + (b->depth == 1 ? 0 : (size_t)d * b->rows * b->stride);
+        sgemm_mixed('N', 'N', a->rows, b->cols, a->cols, 1.0f, a_slice.data, FORMAT_FP32, a_slice.stride,
+                    b_slice, b->format, b->stride, 0.0f, res_slice.data, res_slice.stride, NULL);
+    }
+}
+
+// int8 quantized gemm, int8 x int8 with exact int32 accumulation, on the same five loops and
+// MC/KC/NC blocking as gemm_packed, only the packing and the microkernel change
+// a quantized value q stands for scale * (q - zero_point), A is quantized per row, B per column
+// (per-tensor is just the same scale and zero point repeated)
+typedef struct {
+    const float *a_scale;   // m floats, NULL means 1
+    const int32_t *a_zero;  // m zero points, NULL means 0
+    const float *b_scale;   // n floats, NULL means 1
+    const int32_t *b_zero;  // n zero points, NULL means 0
+} QuantParams;
+
+// q = clamp(round(x / scale) + zero_point, -128, 127), for quantizing activations on the way in
+// and for requantizing a dequantized result before it feeds the next int8 layer
+void quantize_s8(const float *src, int8_t *dst, size_t n, float scale, int32_t zero_point) {
+    float inv = 1.0f / scale;
+    for (size_t i = 0; i < n; i++) {
+        float q = __builtin_nearbyintf(src[i] * inv) + zero_point;
+        dst[i] = (int8_t)(q < -128.0f ? -128.0f : (q > 127.0f ? 127.0f : q));
+    }
+}
+
+// bytes of one packed micro-panel of A (MR rows) or B (NR columns) for a kc deep block
+int s8_panel_a_bytes(int kc) {
+    return s8_layout == S8_QUADS ? round_up(kc, 4) * MR : round_up(kc, 2) * MR * 2;
+}
+
+int s8_panel_b_bytes(int kc) {
+    return s8_layout == S8_QUADS ? round_up(kc, 4) * NR + NR * (int)sizeof(int32_t) : round_up(kc, 2) * NR * 2;
+}
+
+// packs one MR-row micro-panel of A (rows <= MR) in the layout of the selected kernel, missing rows
+// and the k tail are padded with (signed) zeros
+void pack_a_s8(int rows, int kc, const int8_t *a, int lda, void *packed) {
+    if (s8_layout == S8_QUADS) {
+        uint8_t *p = (uint8_t *)packed;
+        for (int k = 0; k < kc; k += 4) {
+            for (int ii = 0; ii < MR; ii++) {
+                for (int kk = 0; kk < 4; kk++) {
+                    *p++ = (uint8_t)((ii < rows && k + kk < kc ? a[(size_t)ii * lda + k + kk] : 0) + 128);
+                }
+            }
+        }
+        return;
+    }
+    int16_t *p = (int16_t *)packed;
+    for (int k = 0; k < kc; k += 2) {
+        for (int ii = 0; ii < MR; ii++) {
+            *p++ = ii < rows ? a[(size_t)ii * lda + k] : 0;
+            *p++ = ii < rows && k + 1 < kc ? a[(size_t)ii * lda + k + 1] : 0;
+        }
+    }
+}
+
+// packs one NR-column micro-panel of B (cols <= NR), quads also get the column sums the vnni kernel needs
+void pack_b_s8(int kc, int cols, const int8_t *b, int ldb, void *packed) {
+    if (s8_layout == S8_QUADS) {
+        int8_t *p = (int8_t *)packed;
+        int32_t sums[NR] = {0};
+        for (int k = 0; k < kc; k += 4) {
+            for (int jj = 0; jj < NR; jj++) {
+                for (int kk = 0; kk < 4; kk++) {
+                    int8_t v = jj < cols && k + kk < kc ? b[(size_t)(k + kk) * ldb + jj] : 0;
+                    sums[jj] += v;
+                    *p++ = v;
+                }
+            }
+        }
+        memcpy(p, sums, sizeof(sums));
+        return;
+    }
+    int16_t *p = (int16_t *)packed;
+    for (int k = 0; k < kc; k += 2) {
+        for (int jj = 0; jj < NR; jj++) {
+            *p++ = jj < cols ? b[(size_t)k * ldb + jj] : 0;
+            *p++ = jj < cols && k + 1 < kc ? b[(size_t)(k + 1) * ldb + jj] : 0;
+        }
+    }
+}
+
+typedef struct {
+    int m, n, k;
+    int mc, kc, nc;
+    const int8_t *a;
+    int lda;
+    const int8_t *b;
+    int ldb;
+    const QuantParams *q;       // NULL: c is int32_t and gets the raw sums
+    const GemmEpilogue *ep;
+    void *c;
+    int ldc;
+    int32_t *row_sums;          // A's rows summed over all of k, only with B zero points
+    int32_t *col_sums;          // B's columns summed over all of k, only with A zero points
+    uint8_t *packed_a;
+    uint8_t *packed_b;
+    Barrier barrier;
+} S8GemmArgs;
+
+// int32 output adds the block's sums to C (first block overwrites), float output dequantizes them:
+//   sum((a - za) * (b - zb)) = sum(a * b) - zb * rowsum(a) - za * colsum(b) + k * za * zb
+// the zero point terms are taken out on the first KC block, every block is scaled and added in float,
+// and ep goes on after the last one
+void s8_write_back(const S8GemmArgs *g, const int32_t *tile, int row0, int col0, int m, int n, int first, int last) {
+    if (g->q == NULL) {
+        int32_t *c = (int32_t *)g->c + (size_t)row0 * g->ldc + col0;
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                c[(size_t)i * g->ldc + j] = first ? tile[i * NR + j] : c[(size_t)i * g->ldc + j] + tile[i * NR + j];
+            }
+        }
+        return;
+    }
+
+    const QuantParams *q = g->q;
+    float *c = (float *)g->c + (size_t)row0 * g->ldc + col0;
+    for (int i = 0; i < m; i++) {
+        int row = row0 + i;
+        float a_scale = q->a_scale == NULL ? 1.0f : q->a_scale[row];
+        int32_t a_zero = q->a_zero == NULL ? 0 : q->a_zero[row];
+        for (int j = 0; j < n; j++) {
+            int col = col0 + j;
+            float b_scale = q->b_scale == NULL ? 1.0f : q->b_scale[col];
+            int64_t v = tile[i * NR + j];
+            if (first) {
+                int32_t b_zero = q->b_zero == NULL ? 0 : q->b_zero[col];
+                if (b_zero != 0) {
+                    v -= (int64_t)b_zero * g->row_sums[row];
+                }
+                if (a_zero != 0) {
+                    v -= (int64_t)a_zero * g->col_sums[col];
+                }
+                v += (int64_t)g->k * a_zero * b_zero;
+            }
+            float out = a_scale * b_scale * (float)v;
+            if (!first) {
+                out += c[(size_t)i * g->ldc + j];
+            }
+            c[(size_t)i * g->ldc + j] = last && g->ep != NULL ? epilogue_apply(g->ep, out, row, col) : out;
+        }
+    }
+}
+
+// gemm_packed_thread with int8 panels, see there for how the work is split
+void gemm_s8_thread(void *arg, int tid, int nthreads) {
+    S8GemmArgs *g = (S8GemmArgs *)arg;
+    int m = g->m, n = g->n, k = g->k;
+    int MC = g->mc, KC = g->kc, NC = g->nc;
+    int start, end;
+    int32_t tile[MR * NR];
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = min_int(NC, n - jc);
+        int b_panels = (nc + NR - 1) / NR;
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = min_int(KC, k - pc);
+            int a_bytes = s8_panel_a_bytes(kc), b_bytes = s8_panel_b_bytes(kc);
+
+            thread_range(b_panels, tid, nthreads, &start, &end);
+            for (int j = start; j < end; j++) {
+                pack_b_s8(kc, min_int(NR, nc - j * NR), g->b + (size_t)pc * g->ldb + jc + j * NR, g->ldb,
+                          g->packed_b + (size_t)j * b_bytes);
+            }
+            thread_range((m + MR - 1) / MR, tid, nthreads, &start, &end);
+            for (int i = start; i < end; i++) {
+                pack_a_s8(min_int(MR, m - i * MR), kc, g->a + (size_t)i * MR * g->lda + pc, g->lda,
+                          g->packed_a + (size_t)i * a_bytes);
+            }
+            barrier_wait(&g->barrier, nthreads);
+
+            int m_blocks = (m + MC - 1) / MC;
+            thread_range(m_blocks * b_panels, tid, nthreads, &start, &end);
+            for (int unit = start; unit < end; unit++) {
+                int ic = unit / b_panels * MC;
+                int jr = unit % b_panels * NR;
+                int mc = min_int(MC, m - ic);
+                for (int ir = 0; ir < mc; ir += MR) {
+                    s8_kernel(kc, g->packed_a + (size_t)(ic + ir) / MR * a_bytes,
+                              g->packed_b + (size_t)jr / NR * b_bytes, tile);
+                    s8_write_back(g, tile, ic + ir, jc + jr, min_int(MR, mc - ir), min_int(NR, nc - jr),
+                                  pc == 0, pc + kc == k);
+                }
+            }
+            barrier_wait(&g->barrier, nthreads);
+        }
+    }
+}
+
+// A (m x k) and B (k x n) are row-major int8 with row strides lda/ldb, C is overwritten
+// q == NULL: C is int32_t, the exact sums, k must stay below 2^17 (2^17 * -128 * -128 is already 2^31)
+// otherwise C is float, dequantized with q, then ep (or NULL) is applied, each KC block is summed in int32
+// and added in float, so any k works
+void gemm_s8_packed(int m, int n, int k, const int8_t *a, int lda, const int8_t *b, int ldb,
+                    const QuantParams *q, const GemmEpilogue *ep, void *c, int ldc) {
+    if (q == NULL && k >= 1 << 17) {
+        fprintf(stderr, "gemm_s8 int32 output needs k < 2^17, got %d\n", k);
+        exit(1);
+    }
+    if (m == 0 || n == 0) {
+        return;
+    }
+
+    int MC = tuning.mc, KC = tuning.kc, NC = tuning.nc;
+    S8GemmArgs g = {m, n, k, MC, KC, NC, a, lda, b, ldb, q, ep, c, ldc, NULL, NULL, NULL, NULL, {0, 0}};
+    if (k == 0) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                if (q == NULL) {
+                    ((int32_t *)c)[(size_t)i * ldc + j] = 0;
+                } else {
+                    ((float *)c)[(size_t)i * ldc + j] = ep == NULL ? 0.0f : epilogue_apply(ep, 0.0f, i, j);
+                }
+            }
+        }
+        return;
+    }
+
+    if (q != NULL && q->b_zero != NULL) {
+        g.row_sums = (int32_t *)calloc(m, sizeof(int32_t));
+        if (g.row_sums == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < m; i++) {
+            for (int p = 0; p < k; p++) {
+                g.row_sums[i] += a[(size_t)i * lda + p];
+            }
+        }
+    }
+    if (q != NULL && q->a_zero != NULL) {
+        g.col_sums = (int32_t *)calloc(n, sizeof(int32_t));
+        if (g.col_sums == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (int p = 0; p < k; p++) {
+            for (int j = 0; j < n; j++) {
+                g.col_sums[j] += b[(size_t)p * ldb + j];
+            }
+        }
+    }
+
+    int kc = min_int(k, KC);
+    g.packed_a = (uint8_t *)allocate_packed(((size_t)m + MR - 1) / MR * s8_panel_a_bytes(kc) / sizeof(float));
+    g.packed_b = (uint8_t *)allocate_packed((size_t)(min_int(n, NC) + NR - 1) / NR * s8_panel_b_bytes(kc) / sizeof(float));
+
+    int units = (m + MC - 1) / MC * ((min_int(n, NC) + NR - 1) / NR);
+    int nthreads = (double)m * n * k < 64.0 * 64 * 64 ? 1 : units;
+    parallel_run(gemm_s8_thread, &g, nthreads);
+
+    free(g.packed_a);
+    free(g.packed_b);
+    free(g.row_sums);
+    free(g.col_sums);
+}
+
+// C (int32) = A * B on raw int8 values
+void gemm_s8(int m, int n, int k, const int8_t *a, int lda, const int8_t *b, int ldb, int32_t *c, int ldc) {
+    gemm_s8_packed(m, n, k, a, lda, b, ldb, NULL, NULL, c, ldc);
+}
+
+// C (float) = dequantized A * B, then ep, q must not be NULL
+void gemm_s8_dequant(int m, int n, int k, const int8_t *a, int lda, const int8_t *b, int ldb,
+                     const QuantParams *q, const GemmEpilogue *ep, float *c, int ldc) {
+    gemm_s8_packed(m, n, k, a, lda, b, ldb, q, ep, c, ldc);
+}
+
+double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// best of three, so one preempted worker doesn't decide the winner
+double time_packed(Matrix *a, Matrix *b, Matrix *res) {
+    double best = 1e30;
+    for (int rep = 0; rep < 3; rep++) {
+        double start = now_seconds();
+        matmul_packed(a, b, res);
+        double t = now_seconds() - start;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+double time_tiled(Matrix *a, Matrix *b, Matrix *res, int tile_size) {
+    double best = 1e30;
+    for (int rep = 0; rep < 3; rep++) {
+        double start = now_seconds();
+        matmul_transpose_tiled(a, b, res, tile_size);
+        double t = now_seconds() - start;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+// tries every candidate for one block size with the others held at their current values, keeps the fastest
+void sweep_block(const char *name, int *field, const int *candidates, int count, Matrix *a, Matrix *b, Matrix *res) {
+    double flops = 2.0 * a->rows * a->cols * b->cols;
+    double best = 1e30;
+    int best_value = *field;
+    for (int i = 0; i < count; i++) {
+        *field = candidates[i];
+        double t = time_packed(a, b, res);
+        printf("%s=%d: %.4f s, %.2f GFLOPS\n", name, candidates[i], t, flops / t / 1e9);
+        if (t < best) {
+            best = t;
+            best_value = candidates[i];
+        }
+    }
+    *field = best_value;
+}
+
+// measures this host instead of trusting the defaults: the thread count first, then KC, MC and NC
+// one at a time (each sweep starts from the previous winners), then the tile size of
+// matmul_transpose_tiled, and writes the winners to the tuning profile that load_tuning() reads
+void autotune(void) {
+    Matrix a, b, res;
+    allocate_matrix_random(&a, 1, 1024, 1024);
+    allocate_matrix_random(&b, 1, 1024, 4096);
+    allocate_matrix_zeros(&res, 1, 1024, 4096);
+    double flops = 2.0 * 1024 * 1024 * 4096;
+
+    // powers of 2 up to the core count, plus the core count itself
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double best = 1e30;
+    int best_threads = 1;
+    for (int threads = 1; ; threads = threads * 2 < cores ? threads * 2 : cores) {
+        set_num_threads(threads);
+        double t = time_packed(&a, &b, &res);
+        printf("threads=%d: %.4f s, %.2f GFLOPS\n", threads, t, flops / t / 1e9);
+        if (t < best) {
+            best = t;
+            best_threads = threads;
+        }
+        if (threads >= cores) {
+            break;
+        }
+    }
+    tuning.num_threads = best_threads;
+    set_num_threads(best_threads);
+
+    // MC a multiple of MR and NC a multiple of NR, so no block ends in a partial micro-panel
+    int kc_candidates[] = {128, 192, 256, 384, 512};
+    int mc_candidates[] = {48, 72, 96, 144, 192, 288};
+    int nc_candidates[] = {512, 1024, 2048, 4080};
+    sweep_block("kc", &tuning.kc, kc_candidates, sizeof(kc_candidates) / sizeof(int), &a, &b, &res);
+    sweep_block("mc", &tuning.mc, mc_candidates, sizeof(mc_candidates) / sizeof(int), &a, &b, &res);
+    sweep_block("nc", &tuning.nc, nc_candidates, sizeof(nc_candidates) / sizeof(int), &a, &b, &res);
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&res);
+
+    Matrix ta, tb, tres;
+    allocate_matrix_random(&ta, 1, 512, 512);
+    allocate_matrix_random(&tb, 1, 512, 512);
+    allocate_matrix_zeros(&tres, 1, 512, 512);
+    int tile_candidates[] = {8, 16, 32, 64, 128};
+    best = 1e30;
+    for (int i = 0; i < (int)(sizeof(tile_candidates) / sizeof(int)); i++) {
+        double t = time_tiled(&ta, &tb, &tres, tile_candidates[i]);
+        printf("tile_size=%d: %.4f s, %.2f GFLOPS\n", tile_candidates[i], t, 2.0 * 512 * 512 * 512 / t / 1e9);
+        if (t < best) {
+            best = t;
+            tuning.tile_size = tile_candidates[i];
+        }
+    }
+    free_matrix(&ta);
+    free_matrix(&tb);
+    free_matrix(&tres);
+
+    save_tuning();
+    printf("mc=%d kc=%d nc=%d tile_size=%d threads=%d written to %s\n",
+           tuning.mc, tuning.kc, tuning.nc, tuning.tile_size, tuning.num_threads, tuning_path());
+}
+
+
+int main() {
+    struct timespec start, end;
+    int sizes[][3] = {{128, 128, 128}, {512, 512, 512}, {1024, 1024, 1024}};
+    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    int num_iterations = 10;
+
+    // srand(time(NULL));
+
+    printf("kernel: %s, threads: %d\n", gemm_kernel_name, get_num_threads());
+    printf("m, n, k, time, GFLOPS\n");
+
+    for (int i = 0; i < num_sizes; i++) {
+        int M = sizes[i][0];
+        int N = sizes[i][1];
+        int K = sizes[i][2];
+
+        Matrix A;
+        Matrix B;
+        Matrix C;
+
+        allocate_matrix_random(&A, 1, M, N);
+        allocate_matrix_random(&B, 1, N, K);
+        allocate_matrix_zeros(&C, 1, M, K);
+
+        for (int iter = 0; iter < num_iterations; iter++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            matmul_packed(&A, &B, &C);
+
+            clock_gettime(CLOCK_MONOTONIC, &end); 
+
+            double time_taken = (end.tv_sec - start.tv_sec) + 
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
+            double flops = 2.0 * M * N * K;
+            double flops_per_second = flops / time_taken / 1e9;  // Convert to gigaflops
+
+            printf("%d, %d, %d, %.6f, %.2f GLOPS\n", M, N, K, time_taken, flops_per_second);
+        }
+
+        free_matrix(&A);
+        free_matrix(&B);
+        free_matrix(&C);
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "../matrix.hpp"
+
+#include <chrono>
+
+using namespace matrix;
+
+template <typename T>
+double max_error(const Matrix<T> &x, const Matrix<T> &y) {
+    double worst = 0.0;
+    for (size_t i = 0; i < x.length; i++) {
+        worst = std::max(worst, (double)std::abs(x.data[i] - y.data[i]));
+    }
+    return worst;
+}
+
+// complex multiply-adds are 8 real flops, real ones 2
+template <typename T>
+void bench(const char *name, double flops_per_madd) {
+    Matrix<T> a = allocate_matrix_random<T>(1, 67, 131);
+    Matrix<T> b = allocate_matrix_random<T>(1, 131, 45);
+    Matrix<T> ref = allocate_matrix_zeros<T>(1, 67, 45);
+    Matrix<T> res = allocate_matrix_zeros<T>(1, 67, 45);
+    matmul(a, b, ref);
+    matmul_packed(a, b, res);
+    printf("%s: max error vs matmul %g\n", name, max_error(ref, res));
+
+    int sizes[] = {128, 512, 1024};
+    for (int n : sizes) {
+        Matrix<T> A = allocate_matrix_random<T>(1, n, n);
+        Matrix<T> B = allocate_matrix_random<T>(1, n, n);
+        Matrix<T> C = allocate_matrix_zeros<T>(1, n, n);
+        matmul_packed(A, B, C);
+        int iterations = 5;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            matmul_packed(A, B, C);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+        printf("%s, %d, %d, %d, %.6f, %.2f GFLOPS\n", name, n, n, n, seconds,
+               flops_per_madd * n * n * n / seconds / 1e9);
+    }
+}
+
+int main() {
+    printf("threads: %d\n", default_num_threads());
+    bench<float>("float", 2.0);
+    bench<double>("double", 2.0);
+    bench<std::complex<float>>("complex<float>", 8.0);
+    bench<std::complex<double>>("complex<double>", 8.0);
+    return 0;
+}
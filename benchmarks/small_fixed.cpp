@@ -0,0 +1,40 @@
+#include "../matrix.hpp"
+
+#include <chrono>
+
+using namespace matrix;
+
+// depth products of M x K times K x N, generic triple loop against the unrolled matmul<M, N, K>
+template <int M, int N, int K>
+void bench(int depth) {
+    Matrix<float> a = allocate_matrix_random<float>(depth, M, K);
+    Matrix<float> b = allocate_matrix_random<float>(depth, K, N);
+    Matrix<float> ref = allocate_matrix_zeros<float>(depth, M, N);
+    Matrix<float> res = allocate_matrix_zeros<float>(depth, M, N);
+
+    auto start = std::chrono::steady_clock::now();
+    matmul(a, b, ref);
+    double generic = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    matmul<M, N, K>(a, b, res);
+    double fixed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    float worst = 0.0f;
+    for (size_t i = 0; i < res.length; i++) {
+        worst = std::max(worst, std::abs(res.data[i] - ref.data[i]));
+    }
+    printf("%dx%dx%d, %d products, generic %.4f s (%.1f M/s), unrolled %.4f s (%.1f M/s), max error %g\n",
+           M, N, K, depth, generic, depth / generic / 1e6, fixed, depth / fixed / 1e6, worst);
+}
+
+int main() {
+    int depth = 1 << 20;
+    bench<2, 2, 2>(depth);
+    bench<3, 3, 3>(depth);
+    bench<4, 4, 4>(depth);
+    bench<4, 1, 4>(depth);
+    bench<8, 8, 8>(depth / 4);
+    bench<16, 16, 16>(depth / 16);
+    return 0;
+}
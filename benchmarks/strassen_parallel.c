@@ -0,0 +1,1443 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// how a Matrix's data was obtained, so free_matrix can hand it back the same way
+// views and wrapped memory are ALLOC_NONE and free_matrix leaves them alone
+typedef enum {
+    ALLOC_NONE,
+    ALLOC_HEAP,     // aligned_alloc
+    ALLOC_MMAP,     // anonymous mapping (huge pages)
+} AllocKind;
+
+typedef struct {
+    int depth;
+    int rows;
+    int cols;
+    int stride;     // row pitch (leading dimension) in floats, cols (or padded, see AllocPolicy) for owned matrices, the parent's for views
+    size_t length;  // elements, depth * rows * cols
+    float *data;
+    AllocKind alloc;
+    size_t alloc_bytes;
+} Matrix;
+
+// allocation policy for allocate_matrix_*, data is always 64 byte aligned (a cache line, one AVX-512 load)
+// pad_stride rounds the row pitch of wide matrices up to whole cache lines and steps it off multiples of
+// 512 bytes: with a 512 or 1024 float pitch every 8th (or 4th) row lands in the same L1 set and loads
+// 4K-alias against stores to the row below
+// huge_pages backs matrices of 2M and up with 2M pages, transparent ones (madvise) or explicit ones
+// (MAP_HUGETLB, needs pages reserved in /proc/sys/vm/nr_hugepages, falls back to transparent), so the
+// 4k-8k sizes stop missing the TLB on every few rows
+// MATRIX_PAD_STRIDE=1 and MATRIX_HUGE_PAGES=thp|hugetlb set it at startup, programs can also change it
+typedef enum {
+    HUGE_PAGES_OFF,
+    HUGE_PAGES_TRANSPARENT,
+    HUGE_PAGES_EXPLICIT,
+} HugePages;
+
+typedef struct {
+    int pad_stride;
+    HugePages huge_pages;
+} AllocPolicy;
+
+AllocPolicy alloc_policy = {0, HUGE_PAGES_OFF};
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+__attribute__((constructor))
+void load_alloc_policy(void) {
+    const char *pad = getenv("MATRIX_PAD_STRIDE");
+    if (pad != NULL) {
+        alloc_policy.pad_stride = atoi(pad) != 0;
+    }
+    const char *huge = getenv("MATRIX_HUGE_PAGES");
+    if (huge != NULL) {
+        if (strcmp(huge, "thp") == 0) {
+            alloc_policy.huge_pages = HUGE_PAGES_TRANSPARENT;
+        } else if (strcmp(huge, "hugetlb") == 0) {
+            alloc_policy.huge_pages = HUGE_PAGES_EXPLICIT;
+        } else {
+            alloc_policy.huge_pages = HUGE_PAGES_OFF;
+        }
+    }
+}
+
+// row pitch for a new matrix, narrow ones aren't padded (their rows don't reach the next set anyway)
+int padded_stride(int cols) {
+    if (!alloc_policy.pad_stride || cols < 128 || cols > INT_MAX - 32) {
+        return cols;
+    }
+    int stride = (cols + 15) & ~15;
+    if (stride % 128 == 0) {
+        stride += 16;
+    }
+    return stride;
+}
+
+// zero filled and 64 byte aligned, the size actually reserved goes to *alloc_bytes for free_matrix
+float *matrix_alloc(size_t bytes, AllocKind *kind, size_t *alloc_bytes) {
+    bytes = (bytes + 63) & ~(size_t)63;
+#ifdef __linux__
+    if (alloc_policy.huge_pages != HUGE_PAGES_OFF && bytes >= HUGE_PAGE_SIZE) {
+        size_t size = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        if (alloc_policy.huge_pages == HUGE_PAGES_EXPLICIT) {
+            void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p != MAP_FAILED) {
+                *kind = ALLOC_MMAP;
+                *alloc_bytes = size;
+                return (float *)p;
+            }
+        }
+        // transparent huge pages only cover 2M aligned ranges, so map 2M extra and trim both ends
+        char *p = (char *)mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            char *aligned = (char *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if (aligned != p) {
+                munmap(p, aligned - p);
+            }
+            munmap(aligned + size, p + HUGE_PAGE_SIZE - aligned);
+            madvise(aligned, size, MADV_HUGEPAGE);
+            *kind = ALLOC_MMAP;
+            *alloc_bytes = size;
+            return (float *)aligned;
+        }
+    }
+#endif
+    float *p = (float *)aligned_alloc(64, bytes);
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(p, 0, bytes);
+    *kind = ALLOC_HEAP;
+    *alloc_bytes = bytes;
+    return p;
+}
+
+// dimensions are int, everything derived from them (lengths, byte counts, offsets) is size_t,
+// a shape that is negative or whose bytes don't fit in a size_t fails here instead of wrapping around
+size_t checked_bytes(int depth, int rows, int cols, size_t elem_size) {
+    size_t bytes;
+    if (depth < 0 || rows < 0 || cols < 0
+        || __builtin_mul_overflow((size_t)depth, (size_t)rows, &bytes)
+        || __builtin_mul_overflow(bytes, (size_t)cols, &bytes)
+        || __builtin_mul_overflow(bytes, elem_size, &bytes)
+        || bytes > SIZE_MAX - (4 << 20)) {
+        fprintf(stderr, "Matrix too large: %d x %d x %d\n", depth, rows, cols);
+        exit(1);
+    }
+    return bytes;
+}
+
+void allocate_matrix_zeros(Matrix *m, int depth, int rows, int cols) {
+    size_t bytes = checked_bytes(depth, rows, cols, sizeof(float));
+    m->depth = depth;
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = padded_stride(cols);
+    m->length = bytes / sizeof(float);
+    m->data = matrix_alloc(checked_bytes(depth, rows, m->stride, sizeof(float)), &m->alloc, &m->alloc_bytes);
+}
+
+void allocate_matrix_random(Matrix *m, int depth, int rows, int cols) {
+    allocate_matrix_zeros(m, depth, rows, cols);
+
+    srand(time(NULL));
+    for (int d = 0; d < depth; d++) {
+        for (int r = 0; r < rows; r++) {
+            float *row = m->data + ((size_t)d * rows + r) * m->stride;
+            for (int c = 0; c < cols; c++) {
+                row[c] = (float)rand() / RAND_MAX;
+            }
+        }
+    }
+}
+
+void allocate_matrix_consecutive(Matrix *m, int depth, int rows, int cols) {
+    allocate_matrix_zeros(m, depth, rows, cols);
+
+    // values count elements, not storage, so a padded pitch gives the same matrix
+    for (int d = 0; d < depth; d++) {
+        for (int r = 0; r < rows; r++) {
+            float *row = m->data + ((size_t)d * rows + r) * m->stride;
+            for (int c = 0; c < cols; c++) {
+                row[c] = (float)(((size_t)d * rows + r) * cols + c);
+            }
+        }
+    }
+}
+
+void free_matrix(Matrix *m) {
+    if (m->alloc == ALLOC_HEAP) {
+        free(m->data);
+    }
+#ifdef __linux__
+    if (m->alloc == ALLOC_MMAP) {
+        munmap(m->data, m->alloc_bytes);
+    }
+#endif
+    m->data = NULL;
+    m->alloc = ALLOC_NONE;
+}
+
+// 64-bit, a 46k x 46k slice already has more than 2^31 elements
+size_t strided_index(Matrix *m, int d, int r, int c) {
+    return ((size_t)d * m->rows + r) * m->stride + c;
+}
+
+// no-copy rows x cols window starting at (r, c) of depth slice d, it shares m's memory,
+// so writes land in m, free_matrix leaves it alone
+void view(Matrix *m, int d, int r, int c, int rows, int cols, Matrix *v) {
+    v->depth = 1;
+    v->rows = rows;
+    v->cols = cols;
+    v->stride = m->stride;
+    v->length = (size_t)rows * cols;
+    v->data = m->data + strided_index(m, d, r, c);
+    v->alloc = ALLOC_NONE;
+}
+
+// slice d as a depth-1 view, a depth-1 m hands out its only slice for every d (broadcasting)
+void slice(Matrix *m, int d, Matrix *s) {
+    view(m, m->depth == 1 ? 0 : d, 0, 0, m->rows, m->cols, s);
+}
+
+float get(Matrix *m, int d, int r, int c) {
+    return m->data[strided_index(m, d, r, c)];
+}
+
+void set(Matrix *m, int d, int r, int c, float value) {
+    m->data[strided_index(m, d, r, c)] = value;
+}
+
+void print_matrix(Matrix *m) {
+    for (int d = 0; d < m->depth; d++) {
+        for (int r = 0; r < m->rows; r++) {
+            for (int c = 0; c < m->cols; c++) {
+                printf("%f ", get(m, d, r, c));
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+}
+
+void matmul(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < a->depth; d++) {
+        for (int r = 0; r < a->rows; r++) {
+            const float *a_row = a->data + strided_index(a, d, r, 0);
+            for (int c = 0; c < b->cols; c++) {
+                const float *b_col = b->data + strided_index(b, d, 0, c);
+                float temp = 0.0f;
+                for (int i = 0; i < a->cols; i++) {
+                    temp += a_row[i] * b_col[(size_t)i * b->stride];
+                }
+                // printf("temp: %f\n", temp);
+                set(res, d, r, c, temp);
+
+            }
+        }
+    }
+}
+
+void add(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < a->depth; d++) {
+        for (int r = 0; r < a->rows; r++) {
+            const float *x = a->data + strided_index(a, d, r, 0);
+            const float *y = b->data + strided_index(b, d, r, 0);
+            float *z = res->data + strided_index(res, d, r, 0);
+            for (int c = 0; c < a->cols; c++) {
+                z[c] = x[c] + y[c];
+            }
+        }
+    }
+}
+
+void sub(Matrix *a, Matrix *b, Matrix *res) {
+    for (int d = 0; d < a->depth; d++) {
+        for (int r = 0; r < a->rows; r++) {
+            const float *x = a->data + strided_index(a, d, r, 0);
+            const float *y = b->data + strided_index(b, d, r, 0);
+            float *z = res->data + strided_index(res, d, r, 0);
+            for (int c = 0; c < a->cols; c++) {
+                z[c] = x[c] - y[c];
+            }
+        }
+    }
+}
+
+// res = a + b + sc * c + sd * d in one pass, sc and sd are +1 or -1 (exact, so the result is the same
+// as three add/sub calls), for Strassen's C11 and C22, which otherwise write res and read it back twice
+// res may be one of the operands
+void add4(Matrix *a, Matrix *b, Matrix *c, float sc, Matrix *d, float sd, Matrix *res) {
+    for (int r = 0; r < res->rows; r++) {
+        const float *pa = a->data + (size_t)r * a->stride;
+        const float *pb = b->data + (size_t)r * b->stride;
+        const float *pc = c->data + (size_t)r * c->stride;
+        const float *pd = d->data + (size_t)r * d->stride;
+        float *out = res->data + (size_t)r * res->stride;
+        for (int col = 0; col < res->cols; col++) {
+            out[col] = pa[col] + pb[col] + sc * pc[col] + sd * pd[col];
+        }
+    }
+}
+
+// res += col * row, col is m x 1 and row is 1 x n (rank-1 update)
+void add_outer(Matrix *col, Matrix *row, Matrix *res) {
+    for (int r = 0; r < res->rows; r++) {
+        float x = col->data[(size_t)r * col->stride];
+        float *out = res->data + (size_t)r * res->stride;
+        for (int c = 0; c < res->cols; c++) {
+            out[c] += x * row->data[c];
+        }
+    }
+}
+
+// quadrants are views into m, nothing is copied, writing to a quadrant writes to m
+void split(Matrix *m, Matrix *a11, Matrix *a12, Matrix *a21, Matrix *a22) {
+    int r = m->rows / 2;
+    int c = m->cols / 2;
+    view(m, 0, 0, 0, r, c, a11);
+    view(m, 0, 0, c, r, c, a12);
+    view(m, 0, r, 0, r, c, a21);
+    view(m, 0, r, c, r, c, a22);
+}
+
+// copies four quadrants back into m, strassens() writes straight into views of res and doesn't need it
+void combine(Matrix *a11, Matrix *a12, Matrix *a21, Matrix *a22, Matrix *m) {
+    int r = m->rows / 2;
+    int c = m->cols / 2;
+    for (int i = 0; i < r; i++) {
+        for (int j = 0; j < c; j++) {
+            m->data[strided_index(m, 0, i, j)] = a11->data[strided_index(a11, 0, i, j)];
+            m->data[strided_index(m, 0, i, j + c)] = a12->data[strided_index(a12, 0, i, j)];
+            m->data[strided_index(m, 0, i + r, j)] = a21->data[strided_index(a21, 0, i, j)];
+            m->data[strided_index(m, 0, i + r, j + c)] = a22->data[strided_index(a22, 0, i, j)];
+        }
+    }
+}
+
+// bump arena for Strassen temporaries, one per worker (see arenas below) so tasks never share one
+// a recursion level takes a mark, carves its temporaries off the top and releases back to the mark,
+// stealing only ever nests whole tasks on top of a waiting one, so every arena stays a stack
+// memory is not zero filled (split/add/sub/matmul overwrite every temporary) and is kept between calls,
+// if a worker runs deeper than expected the arena chains another block instead of failing
+#define ARENA_MAX_BLOCKS 32
+#define ARENA_MIN_BLOCK (1 << 20)
+
+typedef struct {
+    float *blocks[ARENA_MAX_BLOCKS];
+    size_t sizes[ARENA_MAX_BLOCKS];
+    int block;
+    size_t top;
+} Arena;
+
+typedef struct {
+    int block;
+    size_t top;
+} ArenaMark;
+
+// arenas[i] belongs to runtime worker i, a caller that can't get the runtime uses its own serial_arena
+__thread Arena serial_arena;
+__thread Arena *current_arena;
+
+// 16 floats, keeps every temporary on its own 64 byte cache line
+size_t arena_round(size_t floats) {
+    return (floats + 15) & ~(size_t)15;
+}
+
+float *arena_new_block(size_t floats) {
+    float *p = (float *)aligned_alloc(64, floats * sizeof(float));
+    if (p == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    return p;
+}
+
+// makes sure the first block alone can hold `floats`, only valid while the arena is empty
+void arena_reserve(Arena *arena, size_t floats) {
+    floats = arena_round(floats);
+    if (arena->sizes[0] >= floats) {
+        return;
+    }
+    free(arena->blocks[0]);
+    arena->blocks[0] = arena_new_block(floats);
+    arena->sizes[0] = floats;
+}
+
+float *arena_alloc(Arena *arena, size_t floats) {
+    floats = arena_round(floats);
+    while (arena->blocks[arena->block] == NULL || arena->sizes[arena->block] - arena->top < floats) {
+        if (arena->blocks[arena->block] != NULL) {
+            if (arena->block + 1 == ARENA_MAX_BLOCKS) {
+                fprintf(stderr, "Strassen arena exhausted\n");
+                exit(1);
+            }
+            arena->block++;
+            arena->top = 0;
+        }
+        // an unused block that's too small gets replaced, blocks past the current one are always unused
+        if (arena->blocks[arena->block] != NULL && arena->sizes[arena->block] < floats) {
+            free(arena->blocks[arena->block]);
+            arena->blocks[arena->block] = NULL;
+        }
+        if (arena->blocks[arena->block] == NULL) {
+            size_t size = floats > ARENA_MIN_BLOCK ? floats : ARENA_MIN_BLOCK;
+            arena->blocks[arena->block] = arena_new_block(size);
+            arena->sizes[arena->block] = size;
+        }
+    }
+    float *p = arena->blocks[arena->block] + arena->top;
+    arena->top += floats;
+    return p;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark = {arena->block, arena->top};
+    return mark;
+}
+
+void arena_release(Arena *arena, ArenaMark mark) {
+    arena->block = mark.block;
+    arena->top = mark.top;
+}
+
+void arena_free(Arena *arena) {
+    for (int i = 0; i < ARENA_MAX_BLOCKS; i++) {
+        free(arena->blocks[i]);
+        arena->blocks[i] = NULL;
+        arena->sizes[i] = 0;
+    }
+    arena->block = 0;
+    arena->top = 0;
+}
+
+// header for a contiguous rows x cols matrix at data
+void wrap_matrix(Matrix *m, float *data, int rows, int cols) {
+    m->depth = 1;
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = cols;
+    m->length = (size_t)rows * cols;
+    m->data = data;
+    m->alloc = ALLOC_NONE;
+}
+
+// like allocate_matrix_zeros, minus the calloc and the zeroing
+void arena_matrix(Arena *arena, Matrix *m, int rows, int cols) {
+    wrap_matrix(m, arena_alloc(arena, (size_t)rows * cols), rows, cols);
+}
+
+// below strassen_cutoff the leaf kernel takes over, below strassen_serial_cutoff the seven
+// products run one after another, both come from the tuning profile (see autotune below),
+// threads is shared with matrix.c, its autotune measures it
+typedef struct {
+    int strassen_cutoff;
+    int strassen_serial_cutoff;
+    int num_threads;    // 0 means one per online core
+} Tuning;
+
+Tuning tuning = {64, 256, 0};
+
+// MATRIX_TUNING_FILE overrides where the profile lives, same file and format as matrix.c
+const char *tuning_path(void) {
+    const char *env = getenv("MATRIX_TUNING_FILE");
+    return env != NULL && env[0] != '\0' ? env : "matrix_tuning.txt";
+}
+
+void cpu_model(char *buf, int size) {
+    snprintf(buf, size, "unknown");
+    FILE *f = fopen("/proc/cpuinfo", "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            snprintf(buf, size, "%s", colon + 2);
+            buf[strcspn(buf, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(f);
+}
+
+// key=value per line, the gemm block sizes in there belong to matrix.c and are skipped
+__attribute__((constructor))
+void load_tuning(void) {
+    FILE *f = fopen(tuning_path(), "r");
+    if (f == NULL) {
+        return;
+    }
+    char cpu[128], line[256];
+    cpu_model(cpu, sizeof(cpu));
+    Tuning t = tuning;
+    int valid = 1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *eq = strchr(line, '=');
+        if (eq == NULL) {
+            continue;
+        }
+        *eq = '\0';
+        char *value = eq + 1;
+        value[strcspn(value, "\n")] = '\0';
+        if (strcmp(line, "cpu") == 0) {
+            valid = strcmp(value, cpu) == 0;
+        } else if (strcmp(line, "strassen_cutoff") == 0) {
+            t.strassen_cutoff = atoi(value);
+        } else if (strcmp(line, "strassen_serial_cutoff") == 0) {
+            t.strassen_serial_cutoff = atoi(value);
+        } else if (strcmp(line, "threads") == 0) {
+            t.num_threads = atoi(value);
+        }
+    }
+    fclose(f);
+    if (!valid) {
+        fprintf(stderr, "%s was tuned on another cpu, using the defaults\n", tuning_path());
+        return;
+    }
+    // the recursion needs a cutoff of at least 1 to bottom out
+    if (t.strassen_cutoff > 0 && t.strassen_serial_cutoff > 0 && t.num_threads >= 0) {
+        tuning = t;
+    }
+}
+
+// rewrites our keys and keeps the lines matrix.c owns, unless the file was tuned on another cpu
+void save_tuning(void) {
+    char cpu[128];
+    cpu_model(cpu, sizeof(cpu));
+    const char *ours[] = {"cpu", "strassen_cutoff", "strassen_serial_cutoff"};
+    char kept[4096] = "";
+    size_t used = 0;
+
+    FILE *f = fopen(tuning_path(), "r");
+    if (f != NULL) {
+        char line[256];
+        int same_cpu = 1;
+        while (fgets(line, sizeof(line), f) != NULL) {
+            size_t key_len = strcspn(line, "=");
+            int owned = 0;
+            for (int i = 0; i < (int)(sizeof(ours) / sizeof(ours[0])); i++) {
+                owned |= strlen(ours[i]) == key_len && strncmp(line, ours[i], key_len) == 0;
+            }
+            if (key_len == 3 && strncmp(line, "cpu", 3) == 0) {
+                same_cpu = strncmp(line + 4, cpu, strlen(cpu)) == 0 && line[4 + strlen(cpu)] == '\n';
+            }
+            if (!owned && line[key_len] == '=' && used + strlen(line) < sizeof(kept)) {
+                strcpy(kept + used, line);
+                used += strlen(line);
+            }
+        }
+        fclose(f);
+        if (!same_cpu) {
+            kept[0] = '\0';
+        }
+    }
+
+    f = fopen(tuning_path(), "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not write %s\n", tuning_path());
+        return;
+    }
+    fprintf(f, "cpu=%s\nstrassen_cutoff=%d\nstrassen_serial_cutoff=%d\n%s",
+            cpu, tuning.strassen_cutoff, tuning.strassen_serial_cutoff, kept);
+    fclose(f);
+}
+
+// work-stealing task runtime for the seven Strassen products
+// every thread owns a deque: it pushes and pops its own tasks at the bottom (newest first),
+// idle threads steal from the top of someone else's deque (oldest first, so the biggest subproblems)
+// the calling thread is worker 0, workers are started once and sleep while no Strassen is running
+#define MAX_WORKERS 256
+#define DEQUE_SIZE 1024
+
+typedef struct {
+    void (*fn)(void *arg);
+    void *arg;
+    int done;
+} Task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks[DEQUE_SIZE];
+    uint64_t top;       // only ever grow, 64-bit so a long-lived process never wraps them
+    uint64_t bottom;
+} Deque;
+
+typedef struct {
+    pthread_t threads[MAX_WORKERS];
+    Deque deques[MAX_WORKERS];
+    int num_workers;
+    int started;
+    int busy;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_mutex_t run_lock;
+} TaskRuntime;
+
+TaskRuntime runtime = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .run_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+__thread int worker_id = 0;
+Arena arenas[MAX_WORKERS];
+
+void cpu_relax(int spins) {
+    if (spins < 1024) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+// returns 0 when the deque is full, the caller then just runs the task itself
+int deque_push(Deque *q, Task *t) {
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom - q->top == DEQUE_SIZE) {
+        pthread_mutex_unlock(&q->lock);
+        return 0;
+    }
+    q->tasks[q->bottom % DEQUE_SIZE] = t;
+    __atomic_store_n(&q->bottom, q->bottom + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+    return 1;
+}
+
+Task *deque_pop(Deque *q) {
+    Task *t = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        __atomic_store_n(&q->bottom, q->bottom - 1, __ATOMIC_RELAXED);
+        t = q->tasks[q->bottom % DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+Task *deque_steal(Deque *q) {
+    Task *t = NULL;
+    // unlocked peek first so thieves don't hammer the owner's lock on empty deques,
+    // top/bottom are only changed under the lock but stored atomically for this peek
+    if (__atomic_load_n(&q->bottom, __ATOMIC_RELAXED) <= __atomic_load_n(&q->top, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&q->lock);
+    if (q->bottom > q->top) {
+        t = q->tasks[q->top % DEQUE_SIZE];
+        __atomic_store_n(&q->top, q->top + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+void task_run(Task *t) {
+    t->fn(t->arg);
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+}
+
+// pops own work first, otherwise steals from a random victim, returns 0 if nothing was found
+int find_and_run_task(unsigned int *seed) {
+    Task *t = deque_pop(&runtime.deques[worker_id]);
+    if (t == NULL) {
+        int victim = rand_r(seed) % runtime.num_workers;
+        if (victim != worker_id) {
+            t = deque_steal(&runtime.deques[victim]);
+        }
+    }
+    if (t == NULL) {
+        return 0;
+    }
+    task_run(t);
+    return 1;
+}
+
+void task_spawn(Task *t, void (*fn)(void *arg), void *arg) {
+    t->fn = fn;
+    t->arg = arg;
+    t->done = 0;
+    if (!deque_push(&runtime.deques[worker_id], t)) {
+        task_run(t);
+    }
+}
+
+// keeps running other tasks (its own first) until t is finished, so waiting threads never idle
+void task_wait(Task *t) {
+    unsigned int seed = (unsigned int)(uintptr_t)t;
+    int spins = 0;
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        if (find_and_run_task(&seed)) {
+            spins = 0;
+        } else {
+            cpu_relax(spins++);
+        }
+    }
+}
+
+void *runtime_worker(void *p) {
+    worker_id = (int)(intptr_t)p;
+    current_arena = &arenas[worker_id];
+    unsigned int seed = (unsigned int)worker_id * 2654435761u;
+    int spins = 0;
+
+    for (;;) {
+        if (__atomic_load_n(&runtime.busy, __ATOMIC_ACQUIRE) == 0) {
+            pthread_mutex_lock(&runtime.lock);
+            while (runtime.busy == 0 && !runtime.shutdown) {
+                pthread_cond_wait(&runtime.wake, &runtime.lock);
+            }
+            pthread_mutex_unlock(&runtime.lock);
+            if (runtime.shutdown) {
+                return NULL;
+            }
+        }
+        if (find_and_run_task(&seed)) {
+            spins = 0;
+        } else {
+            cpu_relax(spins++);
+        }
+    }
+}
+
+// MATRIX_NUM_THREADS=n overrides the tuned thread count, which overrides one thread per online core
+void start_task_runtime(void) {
+    const char *env = getenv("MATRIX_NUM_THREADS");
+    int num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (env != NULL && atoi(env) > 0) {
+        num_workers = atoi(env);
+    } else if (tuning.num_threads > 0) {
+        num_workers = tuning.num_threads;
+    }
+    if (num_workers > MAX_WORKERS) {
+        num_workers = MAX_WORKERS;
+    }
+
+    runtime.num_workers = num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        pthread_mutex_init(&runtime.deques[i].lock, NULL);
+    }
+    for (int i = 1; i < num_workers; i++) {
+        if (pthread_create(&runtime.threads[i], NULL, runtime_worker, (void *)(intptr_t)i) != 0) {
+            fprintf(stderr, "Thread creation failed\n");
+            exit(1);
+        }
+    }
+    __atomic_store_n(&runtime.started, 1, __ATOMIC_RELEASE);
+}
+
+void set_runtime_busy(int delta) {
+    pthread_mutex_lock(&runtime.lock);
+    __atomic_add_fetch(&runtime.busy, delta, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&runtime.wake);
+    pthread_mutex_unlock(&runtime.lock);
+}
+
+// tasks are only spawned for the first few recursion levels
+// (each parallel level needs its own operand sums for all seven products, so memory grows with it)
+#define STRASSEN_MAX_PARALLEL_DEPTH 3
+
+void strassens_rec(Matrix *a, Matrix *b, Matrix *res, int depth, int parallel_depth);
+
+typedef struct {
+    Matrix *a;
+    Matrix *b;
+    Matrix *res;
+    int depth;
+    int parallel_depth;
+} ProductArgs;
+
+void product_task(void *arg) {
+    ProductArgs *p = (ProductArgs *)arg;
+    strassens_rec(p->a, p->b, p->res, p->depth, p->parallel_depth);
+}
+
+int min3(int a, int b, int c) {
+    int m = a < b ? a : b;
+    return m < c ? m : c;
+}
+
+// dynamic peeling for odd shapes: the recursion runs on the even part
+// res[0:m2, 0:n2] = a[0:m2, 0:k2] * b[0:k2, 0:n2] and this patches in what the odd edges add,
+// a rank-1 update when k is odd, a matrix-vector product for an odd last column and for an odd last row
+// that's O(mn + mk + kn) per level, so it always beats padding the whole matrix to even
+void peel_fixup(Matrix *a, Matrix *b, Matrix *res) {
+    int m = a->rows, k = a->cols, n = b->cols;
+    int m2 = m & ~1, k2 = k & ~1, n2 = n & ~1;
+    Matrix x, y, z;
+
+    if (k != k2) {
+        view(a, 0, 0, k2, m2, 1, &x);
+        view(b, 0, k2, 0, 1, n2, &y);
+        view(res, 0, 0, 0, m2, n2, &z);
+        add_outer(&x, &y, &z);
+    }
+    if (n != n2) {
+        view(a, 0, 0, 0, m2, k, &x);
+        view(b, 0, 0, n2, k, 1, &y);
+        view(res, 0, 0, n2, m2, 1, &z);
+        matmul(&x, &y, &z);
+    }
+    if (m != m2) {
+        view(a, 0, m2, 0, 1, k, &x);
+        view(res, 0, m2, 0, 1, n, &z);
+        matmul(&x, b, &z);
+    }
+}
+
+// a is M x K, b is K x N, any sizes: the recursion splits all three dimensions in half,
+// so the quadrants are (M/2 x K/2) * (K/2 x N/2) and rectangular shapes just stay rectangular
+void strassens_rec(Matrix *a, Matrix *b, Matrix *res, int depth, int parallel_depth) {
+    int m = a->rows, k = a->cols, n = b->cols;
+    if (min3(m, k, n) <= tuning.strassen_cutoff) {
+        matmul(a, b, res);
+        return;
+    }
+    if ((m | k | n) & 1) {
+        Matrix a_even, b_even, res_even;
+        view(a, 0, 0, 0, m & ~1, k & ~1, &a_even);
+        view(b, 0, 0, 0, k & ~1, n & ~1, &b_even);
+        view(res, 0, 0, 0, m & ~1, n & ~1, &res_even);
+        strassens_rec(&a_even, &b_even, &res_even, depth, parallel_depth);
+        peel_fixup(a, b, res);
+        return;
+    }
+
+    int parallel = depth < parallel_depth && min3(m, k, n) > tuning.strassen_serial_cutoff;
+    Arena *arena = current_arena;
+    ArenaMark mark = arena_mark(arena);
+
+    Matrix a11, a12, a21, a22;
+    Matrix b11, b12, b21, b22;
+    Matrix p1, p2, p3, p4, p5, p6, p7;
+    Matrix c11, c12, c21, c22;
+    arena_matrix(arena, &p1, m / 2, n / 2);
+    arena_matrix(arena, &p2, m / 2, n / 2);
+    arena_matrix(arena, &p3, m / 2, n / 2);
+    arena_matrix(arena, &p4, m / 2, n / 2);
+    arena_matrix(arena, &p5, m / 2, n / 2);
+    arena_matrix(arena, &p6, m / 2, n / 2);
+    arena_matrix(arena, &p7, m / 2, n / 2);
+
+    split(a, &a11, &a12, &a21, &a22);
+    split(b, &b11, &b12, &b21, &b22);
+    split(res, &c11, &c12, &c21, &c22);
+
+    if (parallel) {
+        // every product gets its own operand sums, so all seven can run at once
+        Matrix sa[5], sb[5];
+        for (int i = 0; i < 5; i++) {
+            arena_matrix(arena, &sa[i], m / 2, k / 2);
+            arena_matrix(arena, &sb[i], k / 2, n / 2);
+        }
+        sub(&b12, &b22, &sb[0]);   // B12 - B22
+        add(&a11, &a12, &sa[0]);   // A11 + A12
+        add(&a21, &a22, &sa[1]);   // A21 + A22
+        sub(&b21, &b11, &sb[1]);   // B21 - B11
+        add(&a11, &a22, &sa[2]);   // A11 + A22
+        add(&b11, &b22, &sb[2]);   // B11 + B22
+        sub(&a12, &a22, &sa[3]);   // A12 - A22
+        add(&b21, &b22, &sb[3]);   // B21 + B22
+        sub(&a11, &a21, &sa[4]);   // A11 - A21
+        add(&b11, &b12, &sb[4]);   // B11 + B12
+
+        ProductArgs args[7] = {
+            {&a11, &sb[0], &p1, depth + 1, parallel_depth},    // P1 = A11 * (B12 - B22)
+            {&sa[0], &b22, &p2, depth + 1, parallel_depth},    // P2 = (A11 + A12) * B22
+            {&sa[1], &b11, &p3, depth + 1, parallel_depth},    // P3 = (A21 + A22) * B11
+            {&a22, &sb[1], &p4, depth + 1, parallel_depth},    // P4 = A22 * (B21 - B11)
+            {&sa[2], &sb[2], &p5, depth + 1, parallel_depth},  // P5 = (A11 + A22) * (B11 + B22)
+            {&sa[3], &sb[3], &p6, depth + 1, parallel_depth},  // P6 = (A12 - A22) * (B21 + B22)
+            {&sa[4], &sb[4], &p7, depth + 1, parallel_depth},  // P7 = (A11 - A21) * (B11 + B12)
+        };
+        Task tasks[6];
+        for (int i = 0; i < 6; i++) {
+            task_spawn(&tasks[i], product_task, &args[i]);
+        }
+        product_task(&args[6]);
+        for (int i = 5; i >= 0; i--) {
+            task_wait(&tasks[i]);
+        }
+    } else {
+        Matrix temp_a, temp_b;
+        arena_matrix(arena, &temp_a, m / 2, k / 2);
+        arena_matrix(arena, &temp_b, k / 2, n / 2);
+
+        sub(&b12, &b22, &temp_b);  // B12 - B22
+        strassens_rec(&a11, &temp_b, &p1, depth + 1, parallel_depth);     // P1 = A11 * (B12 - B22)
+
+        add(&a11, &a12, &temp_a);       // A11 + A12
+        strassens_rec(&temp_a, &b22, &p2, depth + 1, parallel_depth);     // P2 = (A11 + A12) * B22
+
+        add(&a21, &a22, &temp_a);       // A21 + A22
+        strassens_rec(&temp_a, &b11, &p3, depth + 1, parallel_depth);     // P3 = (A21 + A22) * B11
+
+        sub(&b21, &b11, &temp_b);  // B21 - B11
+        strassens_rec(&a22, &temp_b, &p4, depth + 1, parallel_depth);     // P4 = A22 * (B21 - B11)
+
+        add(&a11, &a22, &temp_a);       // A11 + A22
+        add(&b11, &b22, &temp_b);       // B11 + B22
+        strassens_rec(&temp_a, &temp_b, &p5, depth + 1, parallel_depth);  // P5 = (A11 + A22) * (B11 + B22)
+
+        sub(&a12, &a22, &temp_a);  // A12 - A22
+        add(&b21, &b22, &temp_b);       // B21 + B22
+        strassens_rec(&temp_a, &temp_b, &p6, depth + 1, parallel_depth);  // P6 = (A12 - A22) * (B21 + B22)
+
+        sub(&a11, &a21, &temp_a);  // A11 - A21
+        add(&b11, &b12, &temp_b);       // B11 + B12
+        strassens_rec(&temp_a, &temp_b, &p7, depth + 1, parallel_depth);  // P7 = (A11 - A21) * (B11 + B12)
+    }
+
+    // Calculate the result submatrices, straight into the quadrants of res
+    add4(&p5, &p4, &p2, -1.0f, &p6, 1.0f, &c11);     // C11 = P5 + P4 - P2 + P6
+    add(&p1, &p2, &c12);                            // C12 = P1 + P2
+    add(&p3, &p4, &c21);                            // C21 = P3 + P4
+    add4(&p1, &p5, &p3, -1.0f, &p7, -1.0f, &c22);    // C22 = P1 + P5 - P3 - P7
+
+    // Hand every intermediate matrix of this level back to the arena
+    arena_release(arena, mark);
+}
+
+// arena floats one strassens_rec call takes on the calling thread: 7 products plus one A-sized
+// and one B-sized operand temporary per level (quadrants are views), 5 + 5 operand sums on
+// parallel levels (the calling thread runs one product itself, so it recurses)
+size_t strassen_arena_floats(int m, int k, int n, int depth, int parallel_depth) {
+    if (min3(m, k, n) <= tuning.strassen_cutoff) {
+        return 0;
+    }
+    m &= ~1;
+    k &= ~1;
+    n &= ~1;
+    size_t qa = arena_round((size_t)(m / 2) * (k / 2));
+    size_t qb = arena_round((size_t)(k / 2) * (n / 2));
+    size_t qc = arena_round((size_t)(m / 2) * (n / 2));
+    int parallel = depth < parallel_depth && min3(m, k, n) > tuning.strassen_serial_cutoff;
+    return 7 * qc + (parallel ? 5 : 1) * (qa + qb) + strassen_arena_floats(m / 2, k / 2, n / 2, depth + 1, parallel_depth);
+}
+
+typedef struct {
+    Matrix *a;
+    Matrix *b;
+    Matrix *res;
+    int start;
+    int end;
+} SliceArgs;
+
+// a run of depth slices, each one gets the serial recursion on the arena of whoever runs the task
+void slice_task(void *arg) {
+    SliceArgs *t = (SliceArgs *)arg;
+    for (int d = t->start; d < t->end; d++) {
+        Matrix a, b, res;
+        slice(t->a, d, &a);
+        slice(t->b, d, &b);
+        slice(t->res, d, &res);
+        strassens_rec(&a, &b, &res, 0, 0);
+    }
+}
+
+void check_depths(Matrix *a, Matrix *b, Matrix *res) {
+    if ((a->depth != 1 && a->depth != res->depth) || (b->depth != 1 && b->depth != res->depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a->depth, b->depth, res->depth);
+        exit(1);
+    }
+}
+
+// batched over depth: a and b each have depth 1 or the depth of res, a depth-1 operand is
+// broadcast against every slice without being copied
+// with at least one slice per worker the slices themselves are the tasks (chunked, ~4 per worker),
+// otherwise the slices run one after another and each spawns tasks for as many recursion levels
+// as it takes to get ~4 products per worker (7^depth >= 4 * workers)
+// a second thread calling in while the runtime is busy just gets the serial recursion
+void strassens(Matrix *a, Matrix *b, Matrix *res) {
+    check_depths(a, b, res);
+    if (!__atomic_load_n(&runtime.started, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&runtime.run_lock);
+        if (!runtime.started) {
+            start_task_runtime();
+        }
+        pthread_mutex_unlock(&runtime.run_lock);
+    }
+
+    int depth = res->depth;
+    int parallel_depth = 0;
+    for (int tasks = 1; tasks < 4 * runtime.num_workers && parallel_depth < STRASSEN_MAX_PARALLEL_DEPTH; tasks *= 7) {
+        parallel_depth++;
+    }
+    if (runtime.num_workers == 1 || worker_id != 0 || pthread_mutex_trylock(&runtime.run_lock) != 0) {
+        // the runtime and worker 0's arena belong to another caller, recurse serially on our own arena
+        current_arena = &serial_arena;
+        arena_reserve(current_arena, strassen_arena_floats(a->rows, a->cols, b->cols, 0, 0));
+        SliceArgs all = {a, b, res, 0, depth};
+        slice_task(&all);
+        return;
+    }
+
+    current_arena = &arenas[0];
+    set_runtime_busy(1);
+    if (depth >= runtime.num_workers) {
+        arena_reserve(current_arena, strassen_arena_floats(a->rows, a->cols, b->cols, 0, 0));
+        int chunks = depth < 4 * runtime.num_workers ? depth : 4 * runtime.num_workers;
+        Task *tasks = (Task *)malloc(chunks * sizeof(Task));
+        SliceArgs *args = (SliceArgs *)malloc(chunks * sizeof(SliceArgs));
+        if (tasks == NULL || args == NULL) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (int i = 0; i < chunks; i++) {
+            args[i] = (SliceArgs){a, b, res, (int)((long long)depth * i / chunks), (int)((long long)depth * (i + 1) / chunks)};
+        }
+        for (int i = 1; i < chunks; i++) {
+            task_spawn(&tasks[i], slice_task, &args[i]);
+        }
+        slice_task(&args[0]);
+        for (int i = chunks - 1; i >= 1; i--) {
+            task_wait(&tasks[i]);
+        }
+        free(tasks);
+        free(args);
+    } else {
+        arena_reserve(current_arena, strassen_arena_floats(a->rows, a->cols, b->cols, 0, parallel_depth));
+        for (int d = 0; d < depth; d++) {
+            Matrix a_slice, b_slice, res_slice;
+            slice(a, d, &a_slice);
+            slice(b, d, &b_slice);
+            slice(res, d, &res_slice);
+            strassens_rec(&a_slice, &b_slice, &res_slice, 0, parallel_depth);
+        }
+    }
+    set_runtime_busy(-1);
+    pthread_mutex_unlock(&runtime.run_lock);
+}
+
+// Strassen-Winograd: 7 products and 15 additions instead of 18, scheduled so the quadrants of res
+// double as scratch (Boyer, Dumas, Pernet, Zhou, "Memory efficient scheduling of Strassen-Winograd's
+// matrix multiplication algorithm"), each level only needs X (an A quadrant, later P1) and Y (a B
+// quadrant) on top of res, against 9 temporaries for strassens_rec
+// serial only: every product lands in scratch the next steps depend on
+void strassens_winograd_rec(Matrix *a, Matrix *b, Matrix *res) {
+    int m = a->rows, k = a->cols, n = b->cols;
+    if (min3(m, k, n) <= tuning.strassen_cutoff) {
+        matmul(a, b, res);
+        return;
+    }
+    if ((m | k | n) & 1) {
+        Matrix a_even, b_even, res_even;
+        view(a, 0, 0, 0, m & ~1, k & ~1, &a_even);
+        view(b, 0, 0, 0, k & ~1, n & ~1, &b_even);
+        view(res, 0, 0, 0, m & ~1, n & ~1, &res_even);
+        strassens_winograd_rec(&a_even, &b_even, &res_even);
+        peel_fixup(a, b, res);
+        return;
+    }
+    Arena *arena = current_arena;
+    ArenaMark mark = arena_mark(arena);
+
+    Matrix a11, a12, a21, a22;
+    Matrix b11, b12, b21, b22;
+    Matrix c11, c12, c21, c22;
+    Matrix x, y, p1;
+    split(a, &a11, &a12, &a21, &a22);
+    split(b, &b11, &b12, &b21, &b22);
+    split(res, &c11, &c12, &c21, &c22);
+    // X holds the A-shaped sums first and the C-shaped P1 later, so it's sized for the bigger of the two
+    size_t x_floats = (size_t)(m / 2) * (k > n ? k / 2 : n / 2);
+    float *x_data = arena_alloc(arena, x_floats);
+    wrap_matrix(&x, x_data, m / 2, k / 2);
+    wrap_matrix(&p1, x_data, m / 2, n / 2);
+    arena_matrix(arena, &y, k / 2, n / 2);
+
+    sub(&a11, &a21, &x);                    // S3 = A11 - A21
+    sub(&b22, &b12, &y);                    // T3 = B22 - B12
+    strassens_winograd_rec(&x, &y, &c21);   // C21 = P7 = S3 * T3
+    add(&a21, &a22, &x);                    // S1 = A21 + A22
+    sub(&b12, &b11, &y);                    // T1 = B12 - B11
+    strassens_winograd_rec(&x, &y, &c22);   // C22 = P5 = S1 * T1
+    sub(&x, &a11, &x);                      // S2 = S1 - A11
+    sub(&b22, &y, &y);                      // T2 = B22 - T1
+    strassens_winograd_rec(&x, &y, &c12);   // C12 = P6 = S2 * T2
+    sub(&a12, &x, &x);                      // S4 = A12 - S2
+    strassens_winograd_rec(&x, &b22, &c11); // C11 = P3 = S4 * B22
+    strassens_winograd_rec(&a11, &b11, &p1); // X = P1 = A11 * B11
+    add(&p1, &c12, &c12);                   // C12 = U2 = P1 + P6
+    add(&c12, &c21, &c21);                  // C21 = U3 = U2 + P7
+    add(&c12, &c22, &c12);                  // C12 = U4 = U2 + P5
+    add(&c21, &c22, &c22);                  // C22 = U7 = U3 + P5, final
+    add(&c12, &c11, &c12);                  // C12 = U5 = U4 + P3, final
+    sub(&y, &b21, &y);                      // T4 = T2 - B21
+    strassens_winograd_rec(&a22, &y, &c11); // C11 = P4 = A22 * T4
+    sub(&c21, &c11, &c21);                  // C21 = U6 = U3 - P4, final
+    strassens_winograd_rec(&a12, &b21, &c11); // C11 = P2 = A12 * B21
+    add(&p1, &c11, &c11);                   // C11 = U1 = P1 + P2, final
+
+    arena_release(arena, mark);
+}
+
+size_t strassen_winograd_arena_floats(int m, int k, int n) {
+    if (min3(m, k, n) <= tuning.strassen_cutoff) {
+        return 0;
+    }
+    m &= ~1;
+    k &= ~1;
+    n &= ~1;
+    return arena_round((size_t)(m / 2) * (k > n ? k / 2 : n / 2)) + arena_round((size_t)(k / 2) * (n / 2))
+           + strassen_winograd_arena_floats(m / 2, k / 2, n / 2);
+}
+
+// same contract as strassens(), a and b must not overlap res, slices run one after another
+void strassens_winograd(Matrix *a, Matrix *b, Matrix *res) {
+    check_depths(a, b, res);
+    current_arena = &serial_arena;
+    arena_reserve(current_arena, strassen_winograd_arena_floats(a->rows, a->cols, b->cols));
+    for (int d = 0; d < res->depth; d++) {
+        Matrix a_slice, b_slice, res_slice;
+        slice(a, d, &a_slice);
+        slice(b, d, &b_slice);
+        slice(res, d, &res_slice);
+        strassens_winograd_rec(&a_slice, &b_slice, &res_slice);
+    }
+}
+
+// recursive block (Morton, Z-order) layout: the matrix is padded with zeros to a 2^levels x 2^levels
+// grid of leaf_rows x leaf_cols leaves, each leaf is row-major and the leaves are stored in Z order
+// (11, 12, 21, 22 at every level), so every quadrant at every level is one contiguous quarter of its parent
+// and Strassen needs no split or combine, the operand sums and the quadrant updates are flat loops
+typedef struct {
+    int rows;
+    int cols;
+    int levels;
+    int leaf_rows;
+    int leaf_cols;
+    size_t length;  // padded, leaf_rows * leaf_cols * 4^levels
+    float *data;
+} MortonMatrix;
+
+// levels for an M x K times K x N product: halve until the smallest leaf dimension is at most
+// strassen_cutoff, so the leaves are exactly what strassens_rec would hand the leaf kernel
+int morton_levels(int m, int k, int n) {
+    int levels = 0;
+    while ((min3(m, k, n) + (1 << levels) - 1) >> levels > tuning.strassen_cutoff) {
+        levels++;
+    }
+    return levels;
+}
+
+// zero filled, the padding has to stay zero for the products to come out right
+void allocate_morton(MortonMatrix *z, int rows, int cols, int levels) {
+    z->rows = rows;
+    z->cols = cols;
+    z->levels = levels;
+    z->leaf_rows = (rows + (1 << levels) - 1) >> levels;
+    z->leaf_cols = (cols + (1 << levels) - 1) >> levels;
+    z->length = ((size_t)z->leaf_rows * z->leaf_cols) << (2 * levels);
+    z->data = (float *)aligned_alloc(64, arena_round(z->length) * sizeof(float));
+    if (z->data == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(z->data, 0, z->length * sizeof(float));
+}
+
+void free_morton(MortonMatrix *z) {
+    free(z->data);
+}
+
+// spreads the low 16 bits of x to the even bit positions
+size_t morton_spread(unsigned int x) {
+    size_t v = x & 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// position of leaf (i, j) in Z order, the row bit is the high one so 12 comes before 21
+size_t morton_leaf(int i, int j) {
+    return (morton_spread(i) << 1) | morton_spread(j);
+}
+
+// copies row-major m (one depth slice, can be a view) into z, which has m's shape,
+// a leaf at a time with one memcpy per leaf row, the padding is left untouched
+void to_morton(Matrix *m, MortonMatrix *z) {
+    int grid = 1 << z->levels;
+    size_t leaf = (size_t)z->leaf_rows * z->leaf_cols;
+    for (int i = 0; i < grid; i++) {
+        int r0 = i * z->leaf_rows;
+        int rows = z->rows - r0 < z->leaf_rows ? z->rows - r0 : z->leaf_rows;
+        for (int j = 0; j < grid; j++) {
+            int c0 = j * z->leaf_cols;
+            int cols = z->cols - c0 < z->leaf_cols ? z->cols - c0 : z->leaf_cols;
+            if (rows <= 0 || cols <= 0) {
+                continue;
+            }
+            float *dst = z->data + morton_leaf(i, j) * leaf;
+            for (int r = 0; r < rows; r++) {
+                memcpy(dst + (size_t)r * z->leaf_cols, m->data + (size_t)(r0 + r) * m->stride + c0, cols * sizeof(float));
+            }
+        }
+    }
+}
+
+// the inverse, writes the rows x cols part of z back into m and drops the padding
+void from_morton(MortonMatrix *z, Matrix *m) {
+    int grid = 1 << z->levels;
+    size_t leaf = (size_t)z->leaf_rows * z->leaf_cols;
+    for (int i = 0; i < grid; i++) {
+        int r0 = i * z->leaf_rows;
+        int rows = z->rows - r0 < z->leaf_rows ? z->rows - r0 : z->leaf_rows;
+        for (int j = 0; j < grid; j++) {
+            int c0 = j * z->leaf_cols;
+            int cols = z->cols - c0 < z->leaf_cols ? z->cols - c0 : z->leaf_cols;
+            if (rows <= 0 || cols <= 0) {
+                continue;
+            }
+            const float *src = z->data + morton_leaf(i, j) * leaf;
+            for (int r = 0; r < rows; r++) {
+                memcpy(m->data + (size_t)(r0 + r) * m->stride + c0, src + (size_t)r * z->leaf_cols, cols * sizeof(float));
+            }
+        }
+    }
+}
+
+// flat versions of add, sub and add4 for Morton quadrants, which are single contiguous runs
+void add_flat(const float *a, const float *b, float *res, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        res[i] = a[i] + b[i];
+    }
+}
+
+void sub_flat(const float *a, const float *b, float *res, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        res[i] = a[i] - b[i];
+    }
+}
+
+void add4_flat(const float *a, const float *b, const float *c, float sc, const float *d, float sd, float *res, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        res[i] = a[i] + b[i] + sc * c[i] + sd * d[i];
+    }
+}
+
+// same products and combines as strassens_rec, a, b and res are blocks `levels` above the leaves,
+// a leaf of a is bm x bk, of b bk x bn and of res bm x bn
+void strassens_morton_rec(const float *a, const float *b, float *res, int levels, int bm, int bk, int bn) {
+    if (levels == 0) {
+        Matrix x, y, z;
+        wrap_matrix(&x, (float *)a, bm, bk);
+        wrap_matrix(&y, (float *)b, bk, bn);
+        wrap_matrix(&z, res, bm, bn);
+        matmul(&x, &y, &z);
+        return;
+    }
+    Arena *arena = current_arena;
+    ArenaMark mark = arena_mark(arena);
+
+    size_t qa = ((size_t)bm * bk) << (2 * (levels - 1));
+    size_t qb = ((size_t)bk * bn) << (2 * (levels - 1));
+    size_t qc = ((size_t)bm * bn) << (2 * (levels - 1));
+    const float *a11 = a, *a12 = a + qa, *a21 = a + 2 * qa, *a22 = a + 3 * qa;
+    const float *b11 = b, *b12 = b + qb, *b21 = b + 2 * qb, *b22 = b + 3 * qb;
+    float *c11 = res, *c12 = res + qc, *c21 = res + 2 * qc, *c22 = res + 3 * qc;
+
+    float *p[7];
+    for (int i = 0; i < 7; i++) {
+        p[i] = arena_alloc(arena, qc);
+    }
+    float *temp_a = arena_alloc(arena, qa);
+    float *temp_b = arena_alloc(arena, qb);
+    int l = levels - 1;
+
+    sub_flat(b12, b22, temp_b, qb);
+    strassens_morton_rec(a11, temp_b, p[0], l, bm, bk, bn);        // P1 = A11 * (B12 - B22)
+    add_flat(a11, a12, temp_a, qa);
+    strassens_morton_rec(temp_a, b22, p[1], l, bm, bk, bn);        // P2 = (A11 + A12) * B22
+    add_flat(a21, a22, temp_a, qa);
+    strassens_morton_rec(temp_a, b11, p[2], l, bm, bk, bn);        // P3 = (A21 + A22) * B11
+    sub_flat(b21, b11, temp_b, qb);
+    strassens_morton_rec(a22, temp_b, p[3], l, bm, bk, bn);        // P4 = A22 * (B21 - B11)
+    add_flat(a11, a22, temp_a, qa);
+    add_flat(b11, b22, temp_b, qb);
+    strassens_morton_rec(temp_a, temp_b, p[4], l, bm, bk, bn);     // P5 = (A11 + A22) * (B11 + B22)
+    sub_flat(a12, a22, temp_a, qa);
+    add_flat(b21, b22, temp_b, qb);
+    strassens_morton_rec(temp_a, temp_b, p[5], l, bm, bk, bn);     // P6 = (A12 - A22) * (B21 + B22)
+    sub_flat(a11, a21, temp_a, qa);
+    add_flat(b11, b12, temp_b, qb);
+    strassens_morton_rec(temp_a, temp_b, p[6], l, bm, bk, bn);     // P7 = (A11 - A21) * (B11 + B12)
+
+    add4_flat(p[4], p[3], p[1], -1.0f, p[5], 1.0f, c11, qc);        // C11 = P5 + P4 - P2 + P6
+    add_flat(p[0], p[1], c12, qc);                                  // C12 = P1 + P2
+    add_flat(p[2], p[3], c21, qc);                                  // C21 = P3 + P4
+    add4_flat(p[0], p[4], p[2], -1.0f, p[6], -1.0f, c22, qc);       // C22 = P1 + P5 - P3 - P7
+
+    arena_release(arena, mark);
+}
+
+size_t strassen_morton_arena_floats(int levels, int bm, int bk, int bn) {
+    if (levels == 0) {
+        return 0;
+    }
+    size_t qa = ((size_t)bm * bk) << (2 * (levels - 1));
+    size_t qb = ((size_t)bk * bn) << (2 * (levels - 1));
+    size_t qc = ((size_t)bm * bn) << (2 * (levels - 1));
+    return 7 * arena_round(qc) + arena_round(qa) + arena_round(qb) + strassen_morton_arena_floats(levels - 1, bm, bk, bn);
+}
+
+// res = a * b with all three in Morton layout, allocated with the same levels (morton_levels of the
+// product's M, K, N), serial like strassens_winograd; padding rows and columns come out zero
+void strassens_morton(MortonMatrix *a, MortonMatrix *b, MortonMatrix *res) {
+    if (a->levels != b->levels || a->levels != res->levels || a->leaf_cols != b->leaf_rows
+        || a->leaf_rows != res->leaf_rows || b->leaf_cols != res->leaf_cols) {
+        fprintf(stderr, "Morton layout mismatch: %d levels %dx%d * %d levels %dx%d -> %d levels %dx%d\n",
+                a->levels, a->leaf_rows, a->leaf_cols, b->levels, b->leaf_rows, b->leaf_cols,
+                res->levels, res->leaf_rows, res->leaf_cols);
+        exit(1);
+    }
+    current_arena = &serial_arena;
+    arena_reserve(current_arena, strassen_morton_arena_floats(a->levels, a->leaf_rows, a->leaf_cols, b->leaf_cols));
+    strassens_morton_rec(a->data, b->data, res->data, a->levels, a->leaf_rows, a->leaf_cols, b->leaf_cols);
+}
+
+// gives the arenas' memory back, only call it while no strassens() is running
+void free_strassen_arenas(void) {
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        arena_free(&arenas[i]);
+    }
+    arena_free(&serial_arena);
+}
+
+double now_seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// best of three, so one preempted worker doesn't decide the winner
+double time_strassens(Matrix *a, Matrix *b, Matrix *res) {
+    double best = 1e30;
+    for (int rep = 0; rep < 3; rep++) {
+        double start = now_seconds();
+        strassens(a, b, res);
+        double t = now_seconds() - start;
+        best = t < best ? t : best;
+    }
+    return best;
+}
+
+// tries every candidate with the other setting held at its current value, keeps the fastest
+void sweep_cutoff(const char *name, int *field, const int *candidates, int count, Matrix *a, Matrix *b, Matrix *res) {
+    double best = 1e30;
+    int best_value = *field;
+    for (int i = 0; i < count; i++) {
+        *field = candidates[i];
+        double t = time_strassens(a, b, res);
+        printf("%s=%d: %.4f s\n", name, candidates[i], t);
+        if (t < best) {
+            best = t;
+            best_value = candidates[i];
+        }
+    }
+    *field = best_value;
+}
+
+// measures where Strassen stops paying off on this host: the leaf crossover first, then (with more
+// than one worker) the size below which the products stop being spawned as tasks
+// the thread count is left to matrix.c's autotune, run that one first
+void autotune(void) {
+    Matrix a, b, res;
+    allocate_matrix_random(&a, 1, 1024, 1024);
+    allocate_matrix_random(&b, 1, 1024, 1024);
+    allocate_matrix_zeros(&res, 1, 1024, 1024);
+
+    int cutoff_candidates[] = {16, 32, 64, 128, 256};
+    sweep_cutoff("strassen_cutoff", &tuning.strassen_cutoff, cutoff_candidates,
+                 sizeof(cutoff_candidates) / sizeof(int), &a, &b, &res);
+    if (runtime.num_workers > 1) {
+        int serial_candidates[] = {128, 256, 512};
+        sweep_cutoff("strassen_serial_cutoff", &tuning.strassen_serial_cutoff, serial_candidates,
+                     sizeof(serial_candidates) / sizeof(int), &a, &b, &res);
+    }
+    free_matrix(&a);
+    free_matrix(&b);
+    free_matrix(&res);
+    free_strassen_arenas();
+
+    save_tuning();
+    printf("strassen_cutoff=%d strassen_serial_cutoff=%d written to %s\n",
+           tuning.strassen_cutoff, tuning.strassen_serial_cutoff, tuning_path());
+}
+
+// largest |x - y| over the elements (not the padding) of two same-shaped matrices
+float max_abs_diff(Matrix *x, Matrix *y) {
+    float max_diff = 0.0f;
+    for (int d = 0; d < x->depth; d++) {
+        for (int r = 0; r < x->rows; r++) {
+            for (int c = 0; c < x->cols; c++) {
+                float diff = get(x, d, r, c) - get(y, d, r, c);
+                max_diff = diff > max_diff ? diff : (-diff > max_diff ? -diff : max_diff);
+            }
+        }
+    }
+    return max_diff;
+}
+
+int main() {
+    struct timespec start, end;
+    int sizes[][3] = {{128, 128, 128}, {512, 512, 512}, {1024, 1024, 1024}};
+    int num_sizes = sizeof(sizes) / sizeof(sizes[0]);
+    int num_iterations = 5;
+
+    // srand(time(NULL));
+
+    printf("m, n, k, time, GFLOPS\n");
+
+    for (int i = 0; i < num_sizes; i++) {
+        int M = sizes[i][0];
+        int N = sizes[i][1];
+        int K = sizes[i][2];
+
+        Matrix A;
+        Matrix B;
+        Matrix C;
+
+        allocate_matrix_random(&A, 1, M, N);
+        allocate_matrix_random(&B, 1, N, K);
+        allocate_matrix_zeros(&C, 1, M, K);
+
+        for (int iter = 0; iter < num_iterations; iter++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            strassens(&A, &B, &C);
+
+            clock_gettime(CLOCK_MONOTONIC, &end); 
+
+            double time_taken = (end.tv_sec - start.tv_sec) + 
+                       (end.tv_nsec - start.tv_nsec) / 1e9;
+            double flops = 2.0 * M * N * K;
+            double flops_per_second = flops / time_taken / 1e9;  // Convert to gigaflops
+
+            printf("%d, %d, %d, %.6f, %.2f GLOPS\n", M, N, K, time_taken, flops_per_second);
+        }
+
+        free_matrix(&A);
+        free_matrix(&B);
+        free_matrix(&C);
+    }
+
+    return 0;
+}
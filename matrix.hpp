@@ -0,0 +1,1171 @@
+// header-only C++ version of matrix.c's storage and packed gemm, templated on the element type so
+// float, double and complex<float> (and complex<double>, on the generic kernel) share one copy of
+// the code, MR/NR and the microkernel are picked per type at compile time, MC/KC/NC come from matrix.c's
+// tuning profile when there is one
+// build with -std=c++17, -O3, and -lpthread for the threaded gemm
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATRIX_X86
+#endif
+
+namespace matrix {
+
+// base of the lazy element-wise expressions (see "expressions" below), CRTP so nodes stay concrete types
+template <typename E>
+struct Expr {
+    const E &self() const {
+        return static_cast<const E &>(*this);
+    }
+};
+
+// same layout as the C struct (depth slices of rows x cols, row pitch stride), storage is shared
+// between a matrix and every view or copy of it, so copying a Matrix is cheap and aliases the data
+// assigning an expression is different: it evaluates into the matrix's (or view's) own memory
+template <typename T>
+struct Matrix {
+    int depth = 0;
+    int rows = 0;
+    int cols = 0;
+    int stride = 0;     // row pitch (leading dimension) in elements
+    size_t length = 0;  // elements, depth * rows * cols
+    T *data = nullptr;
+    std::shared_ptr<T> storage;
+
+    // 64-bit, a 46k x 46k slice already has more than 2^31 elements
+    size_t strided_index(int d, int r, int c) const {
+        return ((size_t)d * rows + r) * stride + c;
+    }
+
+    T get(int d, int r, int c) const {
+        return data[strided_index(d, r, c)];
+    }
+
+    void set(int d, int r, int c, T value) {
+        data[strided_index(d, r, c)] = value;
+    }
+
+    Matrix() = default;
+
+    // a new matrix holding the value of e
+    template <typename E>
+    Matrix(const Expr<E> &e);
+
+    template <typename E>
+    Matrix &operator=(const Expr<E> &e);
+
+    template <typename E>
+    Matrix &operator+=(const Expr<E> &e);
+
+    template <typename E>
+    Matrix &operator-=(const Expr<E> &e);
+
+    Matrix &operator+=(const Matrix &m);
+    Matrix &operator-=(const Matrix &m);
+};
+
+// 64 byte aligned, zeroed, freed when the last matrix or view sharing it goes away
+template <typename T>
+std::shared_ptr<T> allocate_storage(size_t count) {
+    size_t bytes = (count * sizeof(T) + 63) / 64 * 64;
+    T *p = static_cast<T *>(std::aligned_alloc(64, bytes == 0 ? 64 : bytes));
+    if (p == nullptr) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(static_cast<void *>(p), 0, bytes);
+    return std::shared_ptr<T>(p, [](T *q) { std::free(q); });
+}
+
+// a shape that is negative or whose bytes don't fit in a size_t fails cleanly instead of wrapping around
+template <typename T>
+Matrix<T> allocate_matrix_zeros(int depth, int rows, int cols) {
+    size_t count;
+    if (depth < 0 || rows < 0 || cols < 0
+        || __builtin_mul_overflow((size_t)depth, (size_t)rows, &count)
+        || __builtin_mul_overflow(count, (size_t)cols, &count)
+        || count > (SIZE_MAX - 64) / sizeof(T)) {
+        fprintf(stderr, "Matrix too large: %d x %d x %d\n", depth, rows, cols);
+        exit(1);
+    }
+    Matrix<T> m;
+    m.depth = depth;
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = cols;
+    m.length = count;
+    m.storage = allocate_storage<T>(m.length);
+    m.data = m.storage.get();
+    return m;
+}
+
+// uniform in [0, 1], both parts for complex types
+template <typename T>
+T random_value() {
+    if constexpr (std::is_arithmetic_v<T>) {
+        return static_cast<T>(rand()) / RAND_MAX;
+    } else {
+        using R = typename T::value_type;
+        R re = static_cast<R>(rand()) / RAND_MAX;
+        return T(re, static_cast<R>(rand()) / RAND_MAX);
+    }
+}
+
+template <typename T>
+Matrix<T> allocate_matrix_random(int depth, int rows, int cols) {
+    Matrix<T> m = allocate_matrix_zeros<T>(depth, rows, cols);
+    for (size_t i = 0; i < m.length; i++) {
+        m.data[i] = random_value<T>();
+    }
+    return m;
+}
+
+template <typename T>
+Matrix<T> allocate_matrix_consecutive(int depth, int rows, int cols) {
+    Matrix<T> m = allocate_matrix_zeros<T>(depth, rows, cols);
+    for (size_t i = 0; i < m.length; i++) {
+        m.data[i] = static_cast<T>(i);
+    }
+    return m;
+}
+
+// no-copy rows x cols window starting at (r, c) of depth slice d, writes land in m
+template <typename T>
+Matrix<T> view(const Matrix<T> &m, int d, int r, int c, int rows, int cols) {
+    Matrix<T> v = m;
+    v.depth = 1;
+    v.rows = rows;
+    v.cols = cols;
+    v.length = (size_t)rows * cols;
+    v.data = m.data + m.strided_index(d, r, c);
+    return v;
+}
+
+// slice d as a depth-1 view, a depth-1 m hands out its only slice for every d (broadcasting)
+template <typename T>
+Matrix<T> slice(const Matrix<T> &m, int d) {
+    return view(m, m.depth == 1 ? 0 : d, 0, 0, m.rows, m.cols);
+}
+
+template <typename T>
+void print_value(T v) {
+    if constexpr (std::is_arithmetic_v<T>) {
+        printf("%f ", static_cast<double>(v));
+    } else {
+        printf("(%f, %f) ", static_cast<double>(v.real()), static_cast<double>(v.imag()));
+    }
+}
+
+template <typename T>
+void print_matrix(const Matrix<T> &m) {
+    for (int d = 0; d < m.depth; d++) {
+        for (int r = 0; r < m.rows; r++) {
+            for (int c = 0; c < m.cols; c++) {
+                print_value(m.get(d, r, c));
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+}
+
+// reference triple loop, res is overwritten
+template <typename T>
+void matmul(const Matrix<T> &a, const Matrix<T> &b, Matrix<T> &res) {
+    for (int d = 0; d < res.depth; d++) {
+        Matrix<T> as = slice(a, d), bs = slice(b, d);
+        for (int r = 0; r < a.rows; r++) {
+            for (int c = 0; c < b.cols; c++) {
+                T temp = T(0);
+                for (int i = 0; i < a.cols; i++) {
+                    temp += as.get(0, r, i) * bs.get(0, i, c);
+                }
+                res.set(d, r, c, temp);
+            }
+        }
+    }
+}
+
+// expressions: a + b - 2 * c on matrices (or views) builds a small tree of nodes, nothing is computed
+// until it's assigned to a Matrix, which then runs one fused loop over the output, so
+// c11 = p5 + p4 - p2 + p6 reads each operand once and writes c11 once instead of three add/sub passes
+// nodes hold their operands' pointers and shapes by value, so an expression must not outlive its matrices
+// operands can alias the destination element for element (c = c + a), not shifted views of it
+
+// leaf, depth 1 broadcasts against the other operands like everywhere else
+template <typename T>
+struct Operand : Expr<Operand<T>> {
+    using value_type = T;
+    const T *data;
+    int depth_, rows_, cols_, stride;
+
+    explicit Operand(const Matrix<T> &m) : data(m.data), depth_(m.depth), rows_(m.rows), cols_(m.cols), stride(m.stride) {}
+
+    int depth() const { return depth_; }
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+
+    // a row of an expression is anything with operator[](col), for a leaf that's just the pointer
+    const T *row(int d, int r) const {
+        return data + (depth_ == 1 ? 0 : (size_t)d * rows_ * stride) + (size_t)r * stride;
+    }
+};
+
+struct Plus {
+    template <typename T>
+    static T apply(T x, T y) { return x + y; }
+};
+
+struct Minus {
+    template <typename T>
+    static T apply(T x, T y) { return x - y; }
+};
+
+template <typename L, typename R, typename Op>
+struct Binary : Expr<Binary<L, R, Op>> {
+    using value_type = typename L::value_type;
+    L l;
+    R r;
+
+    Binary(const L &l_, const R &r_) : l(l_), r(r_) {
+        if (l.rows() != r.rows() || l.cols() != r.cols() ||
+            (l.depth() != 1 && r.depth() != 1 && l.depth() != r.depth())) {
+            fprintf(stderr, "Shape mismatch: %dx%dx%d vs %dx%dx%d\n", l.depth(), l.rows(), l.cols(),
+                    r.depth(), r.rows(), r.cols());
+            exit(1);
+        }
+    }
+
+    int depth() const { return std::max(l.depth(), r.depth()); }
+    int rows() const { return l.rows(); }
+    int cols() const { return l.cols(); }
+
+    struct Row {
+        decltype(std::declval<L>().row(0, 0)) l;
+        decltype(std::declval<R>().row(0, 0)) r;
+        value_type operator[](int c) const { return Op::apply(l[c], r[c]); }
+    };
+
+    Row row(int d, int rr) const {
+        return {l.row(d, rr), r.row(d, rr)};
+    }
+};
+
+template <typename E>
+struct Scaled : Expr<Scaled<E>> {
+    using value_type = typename E::value_type;
+    value_type s;
+    E e;
+
+    Scaled(value_type s_, const E &e_) : s(s_), e(e_) {}
+
+    int depth() const { return e.depth(); }
+    int rows() const { return e.rows(); }
+    int cols() const { return e.cols(); }
+
+    struct Row {
+        value_type s;
+        decltype(std::declval<E>().row(0, 0)) e;
+        value_type operator[](int c) const { return s * e[c]; }
+    };
+
+    Row row(int d, int r) const {
+        return {s, e.row(d, r)};
+    }
+};
+
+template <typename X>
+struct is_matrix : std::false_type {};
+
+template <typename T>
+struct is_matrix<Matrix<T>> : std::true_type {};
+
+// what the operators accept: a Matrix or an expression node
+template <typename X>
+constexpr bool is_operand_v = is_matrix<X>::value || std::is_base_of_v<Expr<X>, X>;
+
+template <typename T>
+Operand<T> operand(const Matrix<T> &m) {
+    return Operand<T>(m);
+}
+
+template <typename E>
+const E &operand(const Expr<E> &e) {
+    return e.self();
+}
+
+template <typename X>
+using operand_t = std::decay_t<decltype(operand(std::declval<const X &>()))>;
+
+template <typename A, typename B, typename = std::enable_if_t<is_operand_v<A> && is_operand_v<B>>>
+Binary<operand_t<A>, operand_t<B>, Plus> operator+(const A &a, const B &b) {
+    return {operand(a), operand(b)};
+}
+
+template <typename A, typename B, typename = std::enable_if_t<is_operand_v<A> && is_operand_v<B>>>
+Binary<operand_t<A>, operand_t<B>, Minus> operator-(const A &a, const B &b) {
+    return {operand(a), operand(b)};
+}
+
+template <typename A, typename = std::enable_if_t<is_operand_v<A>>>
+Scaled<operand_t<A>> operator*(typename operand_t<A>::value_type s, const A &a) {
+    return {s, operand(a)};
+}
+
+template <typename A, typename = std::enable_if_t<is_operand_v<A>>>
+Scaled<operand_t<A>> operator*(const A &a, typename operand_t<A>::value_type s) {
+    return {s, operand(a)};
+}
+
+template <typename A, typename = std::enable_if_t<is_operand_v<A>>>
+Scaled<operand_t<A>> operator-(const A &a) {
+    return {typename operand_t<A>::value_type(-1), operand(a)};
+}
+
+// the single pass: every output element is computed from the operands' rows straight into res
+template <typename T, typename E>
+void assign(Matrix<T> &res, const Expr<E> &expr) {
+    const E &e = expr.self();
+    if (e.rows() != res.rows || e.cols() != res.cols || (e.depth() != 1 && e.depth() != res.depth)) {
+        fprintf(stderr, "Shape mismatch: %dx%dx%d assigned to %dx%dx%d\n", e.depth(), e.rows(), e.cols(),
+                res.depth, res.rows, res.cols);
+        exit(1);
+    }
+    for (int d = 0; d < res.depth; d++) {
+        for (int r = 0; r < res.rows; r++) {
+            T *out = res.data + res.strided_index(d, r, 0);
+            auto row = e.row(d, r);
+#pragma GCC ivdep
+            for (int c = 0; c < res.cols; c++) {
+                out[c] = row[c];
+            }
+        }
+    }
+}
+
+template <typename T>
+template <typename E>
+Matrix<T>::Matrix(const Expr<E> &e) : Matrix(allocate_matrix_zeros<T>(e.self().depth(), e.self().rows(), e.self().cols())) {
+    assign(*this, e);
+}
+
+template <typename T>
+template <typename E>
+Matrix<T> &Matrix<T>::operator=(const Expr<E> &e) {
+    assign(*this, e);
+    return *this;
+}
+
+template <typename T>
+template <typename E>
+Matrix<T> &Matrix<T>::operator+=(const Expr<E> &e) {
+    assign(*this, *this + e.self());
+    return *this;
+}
+
+template <typename T>
+template <typename E>
+Matrix<T> &Matrix<T>::operator-=(const Expr<E> &e) {
+    assign(*this, *this - e.self());
+    return *this;
+}
+
+template <typename T>
+Matrix<T> &Matrix<T>::operator+=(const Matrix<T> &m) {
+    assign(*this, *this + m);
+    return *this;
+}
+
+template <typename T>
+Matrix<T> &Matrix<T>::operator-=(const Matrix<T> &m) {
+    assign(*this, *this - m);
+    return *this;
+}
+
+// blocking per element type, MR x NR is the register tile of the microkernel, MC x KC of A is sized
+// for L2 and KC x NC of B for L3, the same byte budgets as matrix.c's defaults so wider types get
+// smaller blocks, MC/KC/NC here are only the defaults, see blocks() for the tuned ones
+// anything without a specialization (complex<double>, integers) gets a small tile and the generic kernel
+template <typename T>
+struct Blocking {
+    static constexpr int MR = 4, NR = 4, MC = 64, KC = 128, NC = 1024;
+};
+
+template <>
+struct Blocking<float> {
+    static constexpr int MR = 6, NR = 16, MC = 72, KC = 256, NC = 4080;
+};
+
+// 6 rows x 2 ymm of 4 doubles, 12 accumulators like the float kernel
+template <>
+struct Blocking<double> {
+    static constexpr int MR = 6, NR = 8, MC = 72, KC = 256, NC = 2040;
+};
+
+// 3 rows x 2 ymm of 4 complex, with two accumulators per output vector (see kernel_avx2 below)
+template <>
+struct Blocking<std::complex<float>> {
+    static constexpr int MR = 3, NR = 8, MC = 48, KC = 256, NC = 2040;
+};
+
+// matrix.c's tuning profile (written by `matrix --autotune`), read once on first use, the same file,
+// keys and cpu check as its load_tuning(), fields stay 0 when there's no valid profile
+struct Tuning {
+    int mc = 0;
+    int kc = 0;
+    int nc = 0;
+    int num_threads = 0;
+};
+
+inline Tuning load_tuning() {
+    const char *env = getenv("MATRIX_TUNING_FILE");
+    const char *path = env != nullptr && env[0] != '\0' ? env : "matrix_tuning.txt";
+    Tuning t;
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return t;
+    }
+    char cpu[128] = "unknown", line[256];
+    FILE *info = fopen("/proc/cpuinfo", "r");
+    if (info != nullptr) {
+        while (fgets(line, sizeof(line), info) != nullptr) {
+            char *colon = strchr(line, ':');
+            if (strncmp(line, "model name", 10) == 0 && colon != nullptr) {
+                snprintf(cpu, sizeof(cpu), "%s", colon + 2);
+                cpu[strcspn(cpu, "\n")] = '\0';
+                break;
+            }
+        }
+        fclose(info);
+    }
+    bool valid = true;
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        char *eq = strchr(line, '=');
+        if (eq == nullptr) {
+            continue;
+        }
+        *eq = '\0';
+        char *value = eq + 1;
+        value[strcspn(value, "\n")] = '\0';
+        if (strcmp(line, "cpu") == 0) {
+            valid = strcmp(value, cpu) == 0;
+        } else if (strcmp(line, "mc") == 0) {
+            t.mc = atoi(value);
+        } else if (strcmp(line, "kc") == 0) {
+            t.kc = atoi(value);
+        } else if (strcmp(line, "nc") == 0) {
+            t.nc = atoi(value);
+        } else if (strcmp(line, "threads") == 0) {
+            t.num_threads = atoi(value);
+        }
+    }
+    fclose(f);
+    if (!valid) {
+        fprintf(stderr, "%s was tuned on another cpu, using the defaults\n", path);
+        return Tuning();
+    }
+    if (t.mc <= 0 || t.kc <= 0 || t.nc <= 0 || t.num_threads < 0) {
+        return Tuning();
+    }
+    return t;
+}
+
+inline const Tuning &tuning() {
+    static const Tuning t = load_tuning();
+    return t;
+}
+
+struct Blocks {
+    int mc;
+    int kc;
+    int nc;
+};
+
+// MC/KC/NC for T: the profile is measured on float, so its byte budgets carry over, MC and NC shrink
+// by sizeof(T) / sizeof(float) (rounded to whole micro-panels) and KC stays, like the Blocking defaults
+template <typename T>
+Blocks blocks() {
+    static const Blocks b = [] {
+        const int MR = Blocking<T>::MR, NR = Blocking<T>::NR;
+        const Tuning &t = tuning();
+        if (t.mc == 0) {
+            return Blocks{Blocking<T>::MC, Blocking<T>::KC, Blocking<T>::NC};
+        }
+        int mc = (int)((long long)t.mc * sizeof(float) / sizeof(T)) / MR * MR;
+        int nc = (int)((long long)t.nc * sizeof(float) / sizeof(T)) / NR * NR;
+        return Blocks{std::max(mc, MR), t.kc, std::max(nc, NR)};
+    }();
+    return b;
+}
+
+// MR x NR tile of beta * C + acc, only the top-left m x n part, beta == 0 never reads C
+template <typename T>
+void write_back(const T *tile, T *c, int rsc, int m, int n, T beta) {
+    constexpr int NR = Blocking<T>::NR;
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < n; j++) {
+            c[i * rsc + j] = beta == T(0) ? tile[i * NR + j] : beta * c[i * rsc + j] + tile[i * NR + j];
+        }
+    }
+}
+
+// a * b added to acc, complex products written out so they don't go through the NaN-checking
+// __mulsc3/__muldc3 that operator* calls without -ffast-math
+template <typename T>
+inline void multiply_add(T &acc, T a, T b) {
+    if constexpr (std::is_arithmetic_v<T>) {
+        acc += a * b;
+    } else {
+        acc = T(acc.real() + a.real() * b.real() - a.imag() * b.imag(),
+                acc.imag() + a.real() * b.imag() + a.imag() * b.real());
+    }
+}
+
+// plain loops over a fixed-size acc, B's row and A's column are copied to locals first so the
+// compiler can see they don't alias acc, real types go through 16 byte GCC/clang vector types
+// (SSE on x86, NEON on M series) because a scalar acc[MR][NR] doesn't get kept in registers
+template <typename T>
+void kernel_generic(int kc, const T *a, const T *b, T *c, int rsc, int m, int n, T beta) {
+    constexpr int MR = Blocking<T>::MR, NR = Blocking<T>::NR;
+    if constexpr (std::is_floating_point_v<T>) {
+        constexpr int W = 16 / sizeof(T);
+        typedef T vec __attribute__((vector_size(16)));
+        vec acc[MR][NR / W] = {};
+        for (int p = 0; p < kc; p++) {
+            vec bv[NR / W];
+            memcpy(bv, b, sizeof(bv));
+            for (int i = 0; i < MR; i++) {
+                vec ai = vec{} + a[i];
+                for (int j = 0; j < NR / W; j++) {
+                    acc[i][j] += ai * bv[j];
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+        T tile[MR * NR];
+        memcpy(tile, acc, sizeof(tile));
+        write_back(tile, c, rsc, m, n, beta);
+    } else {
+        T acc[MR][NR] = {};
+        for (int p = 0; p < kc; p++) {
+            T av[MR], bv[NR];
+            std::copy(a, a + MR, av);
+            std::copy(b, b + NR, bv);
+            for (int i = 0; i < MR; i++) {
+                for (int j = 0; j < NR; j++) {
+                    multiply_add(acc[i][j], av[i], bv[j]);
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+        write_back(&acc[0][0], c, rsc, m, n, beta);
+    }
+}
+
+#ifdef MATRIX_X86
+// 6x16 floats in 12 ymm, each k step is two aligned loads of B, six broadcasts of A and twelve fmas
+__attribute__((target("avx2,fma")))
+inline void kernel_avx2(int kc, const float *a, const float *b, float *c, int rsc, int m, int n, float beta) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        ai = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(ai, b0, c00);
+        c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10);
+        c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20);
+        c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30);
+        c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ai, b0, c40);
+        c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ai, b0, c50);
+        c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += 6;
+        b += 16;
+    }
+    alignas(32) float tile[6 * 16];
+    __m256 acc[12] = {c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51};
+    for (int i = 0; i < 12; i++) {
+        _mm256_store_ps(tile + i * 8, acc[i]);
+    }
+    write_back(tile, c, rsc, m, n, beta);
+}
+
+// 6x8 doubles in 12 ymm, same shape of loop as the float kernel at half the columns
+__attribute__((target("avx2,fma")))
+inline void kernel_avx2(int kc, const double *a, const double *b, double *c, int rsc, int m, int n, double beta) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    for (int p = 0; p < kc; p++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40);
+        c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50);
+        c51 = _mm256_fmadd_pd(ai, b1, c51);
+        a += 6;
+        b += 8;
+    }
+    alignas(32) double tile[6 * 8];
+    __m256d acc[12] = {c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51};
+    for (int i = 0; i < 12; i++) {
+        _mm256_store_pd(tile + i * 4, acc[i]);
+    }
+    write_back(tile, c, rsc, m, n, beta);
+}
+
+// 3x8 complex floats, a ymm holds 4 interleaved (re, im) pairs of B
+// instead of a complex multiply every k step, re(a) * b and im(a) * b go into separate accumulators
+// with plain fmas, and are combined once at the end: re(a) * b + i * im(a) * b is
+// (re*br - im*bi, re*bi + im*br), a pair swap of the second accumulator and one addsub
+__attribute__((target("avx2,fma")))
+inline void kernel_avx2(int kc, const std::complex<float> *a, const std::complex<float> *b,
+                        std::complex<float> *c, int rsc, int m, int n, std::complex<float> beta) {
+    const float *af = reinterpret_cast<const float *>(a);
+    const float *bf = reinterpret_cast<const float *>(b);
+    __m256 r00 = _mm256_setzero_ps(), r01 = _mm256_setzero_ps(), i00 = _mm256_setzero_ps(), i01 = _mm256_setzero_ps();
+    __m256 r10 = _mm256_setzero_ps(), r11 = _mm256_setzero_ps(), i10 = _mm256_setzero_ps(), i11 = _mm256_setzero_ps();
+    __m256 r20 = _mm256_setzero_ps(), r21 = _mm256_setzero_ps(), i20 = _mm256_setzero_ps(), i21 = _mm256_setzero_ps();
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(bf);
+        __m256 b1 = _mm256_load_ps(bf + 8);
+        __m256 ar, ai;
+        ar = _mm256_broadcast_ss(af + 0);
+        ai = _mm256_broadcast_ss(af + 1);
+        r00 = _mm256_fmadd_ps(ar, b0, r00);
+        r01 = _mm256_fmadd_ps(ar, b1, r01);
+        i00 = _mm256_fmadd_ps(ai, b0, i00);
+        i01 = _mm256_fmadd_ps(ai, b1, i01);
+        ar = _mm256_broadcast_ss(af + 2);
+        ai = _mm256_broadcast_ss(af + 3);
+        r10 = _mm256_fmadd_ps(ar, b0, r10);
+        r11 = _mm256_fmadd_ps(ar, b1, r11);
+        i10 = _mm256_fmadd_ps(ai, b0, i10);
+        i11 = _mm256_fmadd_ps(ai, b1, i11);
+        ar = _mm256_broadcast_ss(af + 4);
+        ai = _mm256_broadcast_ss(af + 5);
+        r20 = _mm256_fmadd_ps(ar, b0, r20);
+        r21 = _mm256_fmadd_ps(ar, b1, r21);
+        i20 = _mm256_fmadd_ps(ai, b0, i20);
+        i21 = _mm256_fmadd_ps(ai, b1, i21);
+        af += 6;
+        bf += 16;
+    }
+    alignas(32) std::complex<float> tile[3 * 8];
+    float *tf = reinterpret_cast<float *>(tile);
+    __m256 re[6] = {r00, r01, r10, r11, r20, r21};
+    __m256 im[6] = {i00, i01, i10, i11, i20, i21};
+    for (int i = 0; i < 6; i++) {
+        _mm256_store_ps(tf + i * 8, _mm256_addsub_ps(re[i], _mm256_permute_ps(im[i], 0xB1)));
+    }
+    write_back(tile, c, rsc, m, n, beta);
+}
+#endif
+
+template <typename T>
+using KernelFn = void (*)(int kc, const T *a, const T *b, T *c, int rsc, int m, int n, T beta);
+
+// picked on first use from cpuid, MATRIX_KERNEL=generic forces the fallback like in matrix.c
+template <typename T>
+KernelFn<T> select_kernel() {
+    const char *forced = getenv("MATRIX_KERNEL");
+    if (forced != nullptr && strcmp(forced, "generic") == 0) {
+        return kernel_generic<T>;
+    }
+#ifdef MATRIX_X86
+    constexpr bool has_avx2 = std::is_same_v<T, float> || std::is_same_v<T, double> ||
+                              std::is_same_v<T, std::complex<float>>;
+    if constexpr (has_avx2) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            return static_cast<KernelFn<T>>(kernel_avx2);
+        }
+    }
+#endif
+    return kernel_generic<T>;
+}
+
+template <typename T>
+KernelFn<T> gemm_kernel() {
+    static const KernelFn<T> kernel = select_kernel<T>();
+    return kernel;
+}
+
+// packs an mc x kc block of A into MR-row micro-panels ([k][MR]), alpha folded in, rows past mc zeroed
+template <typename T>
+void pack_a(int mc, int kc, T alpha, const T *a, int rsa, int csa, T *packed) {
+    constexpr int MR = Blocking<T>::MR;
+    for (int i = 0; i < mc; i += MR) {
+        int rows = std::min(MR, mc - i);
+        for (int p = 0; p < kc; p++) {
+            for (int ii = 0; ii < MR; ii++) {
+                packed[ii] = ii < rows ? alpha * a[(i + ii) * rsa + p * csa] : T(0);
+            }
+            packed += MR;
+        }
+    }
+}
+
+// packs a kc x nc panel of B into NR-column micro-panels ([k][NR])
+template <typename T>
+void pack_b(int kc, int nc, const T *b, int rsb, int csb, T *packed) {
+    constexpr int NR = Blocking<T>::NR;
+    for (int j = 0; j < nc; j += NR) {
+        int cols = std::min(NR, nc - j);
+        for (int p = 0; p < kc; p++) {
+            for (int jj = 0; jj < NR; jj++) {
+                packed[jj] = jj < cols ? b[p * rsb + (j + jj) * csb] : T(0);
+            }
+            packed += NR;
+        }
+    }
+}
+
+// the five Goto loops on one thread, C (m x n) = alpha * A * B + beta * C
+template <typename T>
+void gemm_serial(int m, int n, int k, T alpha, const T *a, int rsa, int csa, const T *b, int rsb, int csb,
+                 T beta, T *c, int rsc) {
+    constexpr int MR = Blocking<T>::MR, NR = Blocking<T>::NR;
+    const Blocks blocking = blocks<T>();
+    const int MC = blocking.mc, KC = blocking.kc, NC = blocking.nc;
+    KernelFn<T> kernel = gemm_kernel<T>();
+    int kc_max = std::min(k, KC);
+    std::shared_ptr<T> packed_a = allocate_storage<T>((size_t)(std::min(m, MC) + MR - 1) / MR * MR * kc_max);
+    std::shared_ptr<T> packed_b = allocate_storage<T>((size_t)(std::min(n, NC) + NR - 1) / NR * NR * kc_max);
+
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = std::min(NC, n - jc);
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = std::min(KC, k - pc);
+            pack_b(kc, nc, b + (size_t)pc * rsb + (size_t)jc * csb, rsb, csb, packed_b.get());
+            T block_beta = pc == 0 ? beta : T(1);
+            for (int ic = 0; ic < m; ic += MC) {
+                int mc = std::min(MC, m - ic);
+                pack_a(mc, kc, alpha, a + (size_t)ic * rsa + (size_t)pc * csa, rsa, csa, packed_a.get());
+                for (int jr = 0; jr < nc; jr += NR) {
+                    for (int ir = 0; ir < mc; ir += MR) {
+                        kernel(kc, packed_a.get() + ir * kc, packed_b.get() + jr * kc,
+                               c + (size_t)(ic + ir) * rsc + jc + jr, rsc,
+                               std::min(MR, mc - ir), std::min(NR, nc - jr), block_beta);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// MATRIX_NUM_THREADS=n overrides the tuned thread count, which overrides one thread per online core
+inline int default_num_threads() {
+    const char *env = getenv("MATRIX_NUM_THREADS");
+    if (env != nullptr && atoi(env) > 0) {
+        return atoi(env);
+    }
+    if (tuning().num_threads > 0) {
+        return tuning().num_threads;
+    }
+    int n = (int)std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+// set on workers (and on the caller while it runs a job) so nested parallel calls run serially
+inline thread_local bool in_parallel_region = false;
+
+// persistent pool like matrix.c's parallel_run: workers are started on first use, pinned, and reused by
+// every gemm, the calling thread takes part as tid 0, workers are tid 1..size()-1
+// nested calls, or calls while another thread owns the pool, just run serially
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads) {
+        for (int tid = 1; tid < num_threads; tid++) {
+            workers_.emplace_back([this, tid] { work(tid); });
+#ifdef __linux__
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(tid % std::max(1, (int)std::thread::hardware_concurrency()), &set);
+            pthread_setaffinity_np(workers_.back().native_handle(), sizeof(set), &set);
+#endif
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            shutdown_ = true;
+            job_++;
+        }
+        wake_.notify_all();
+        for (std::thread &t : workers_) {
+            t.join();
+        }
+    }
+
+    int size() const {
+        return (int)workers_.size() + 1;
+    }
+
+    // runs fn(tid, nthreads) on nthreads threads and returns once all of them are done
+    void run(int nthreads, const std::function<void(int, int)> &fn) {
+        nthreads = std::min(nthreads, size());
+        std::unique_lock<std::mutex> owner(run_mutex_, std::try_to_lock);
+        if (nthreads <= 1 || in_parallel_region || !owner.owns_lock()) {
+            fn(0, 1);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            fn_ = &fn;
+            active_ = nthreads;
+            pending_ = (int)workers_.size();
+            job_++;
+        }
+        wake_.notify_all();
+
+        in_parallel_region = true;
+        fn(0, nthreads);
+        in_parallel_region = false;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    void work(int tid) {
+        in_parallel_region = true;
+        long long seen = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&] { return job_ != seen; });
+            seen = job_;
+            if (shutdown_) {
+                return;
+            }
+            const std::function<void(int, int)> *fn = fn_;
+            int active = active_;
+            lock.unlock();
+            if (tid < active) {
+                (*fn)(tid, active);
+            }
+            lock.lock();
+            if (--pending_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(int, int)> *fn_ = nullptr;
+    int active_ = 0;
+    int pending_ = 0;
+    long long job_ = 0;
+    bool shutdown_ = false;
+};
+
+inline ThreadPool &thread_pool() {
+    static ThreadPool pool(default_num_threads());
+    return pool;
+}
+
+// C (m x n, row stride rsc) = alpha * A (m x k) * B (k x n) + beta * C, strides as in matrix.c's
+// gemm_packed (swap rsa/csa for a transposed A), beta == 0 never reads C
+// C is split into column ranges of whole micro-panels, one per pool thread, each running the five loops
+// on its own range (A gets packed once per thread, which is cheap next to the multiply)
+template <typename T>
+void gemm(int m, int n, int k, T alpha, const T *a, int rsa, int csa, const T *b, int rsb, int csb,
+          T beta, T *c, int rsc) {
+    if (m == 0 || n == 0) {
+        return;
+    }
+    if (k == 0 || alpha == T(0)) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                c[(size_t)i * rsc + j] = beta == T(0) ? T(0) : beta * c[(size_t)i * rsc + j];
+            }
+        }
+        return;
+    }
+
+    constexpr int NR = Blocking<T>::NR;
+    int panels = (n + NR - 1) / NR;
+    int nthreads = (double)m * n * k < 64.0 * 64 * 64 ? 1 : std::min(thread_pool().size(), panels);
+    if (nthreads == 1) {
+        gemm_serial(m, n, k, alpha, a, rsa, csa, b, rsb, csb, beta, c, rsc);
+        return;
+    }
+    thread_pool().run(nthreads, [&](int tid, int nt) {
+        int j0 = (int)((long long)panels * tid / nt) * NR;
+        int j1 = std::min(n, (int)((long long)panels * (tid + 1) / nt) * NR);
+        if (j0 < j1) {
+            gemm_serial(m, j1 - j0, k, alpha, a, rsa, csa, b + (size_t)j0 * csb, rsb, csb, beta, c + j0, rsc);
+        }
+    });
+}
+
+// BLAS front door on row-major storage, C = alpha * op(A) * op(B) + beta * C, op(X) is X ('N'),
+// X^T ('T') or the conjugate transpose ('C', same as 'T' for real types)
+template <typename T>
+void gemm(char trans_a, char trans_b, int m, int n, int k, T alpha, const T *a, int lda, const T *b, int ldb,
+          T beta, T *c, int ldc) {
+    // either case, like sgemm and reference BLAS
+    trans_a = (char)std::toupper((unsigned char)trans_a);
+    trans_b = (char)std::toupper((unsigned char)trans_b);
+    const char *bad = nullptr;
+    if (trans_a != 'N' && trans_a != 'T' && trans_a != 'C') {
+        bad = "trans_a";
+    } else if (trans_b != 'N' && trans_b != 'T' && trans_b != 'C') {
+        bad = "trans_b";
+    } else if (m < 0 || n < 0 || k < 0) {
+        bad = "m, n or k";
+    } else if (lda < std::max(1, trans_a == 'N' ? k : m)) {
+        bad = "lda";
+    } else if (ldb < std::max(1, trans_b == 'N' ? n : k)) {
+        bad = "ldb";
+    } else if (ldc < std::max(1, n)) {
+        bad = "ldc";
+    }
+    if (bad != nullptr) {
+        fprintf(stderr, "gemm: illegal value for %s\n", bad);
+        exit(1);
+    }
+
+    if (m == 0 || n == 0) {
+        return;
+    }
+
+    // conjugating needs a copy, the packing routines only know strides, op(X) = X^H means X is stored
+    // k x m (A) or n x k (B), copied row by row into a dense buffer since the last row ends at m (or k),
+    // not at lda (or ldb)
+    std::vector<T> conj_a, conj_b;
+    if constexpr (!std::is_arithmetic_v<T>) {
+        if (trans_a == 'C') {
+            conj_a.resize((size_t)k * m);
+            for (int p = 0; p < k; p++) {
+                for (int i = 0; i < m; i++) {
+                    conj_a[(size_t)p * m + i] = std::conj(a[(size_t)p * lda + i]);
+                }
+            }
+            a = conj_a.data();
+            lda = m;
+        }
+        if (trans_b == 'C') {
+            conj_b.resize((size_t)n * k);
+            for (int j = 0; j < n; j++) {
+                for (int p = 0; p < k; p++) {
+                    conj_b[(size_t)j * k + p] = std::conj(b[(size_t)j * ldb + p]);
+                }
+            }
+            b = conj_b.data();
+            ldb = std::max(1, k);
+        }
+    }
+    gemm(m, n, k, alpha, a, trans_a == 'N' ? lda : 1, trans_a == 'N' ? 1 : lda,
+         b, trans_b == 'N' ? ldb : 1, trans_b == 'N' ? 1 : ldb, beta, c, ldc);
+}
+
+// res = a * b for every depth slice, a or b can have depth 1 and is then broadcast, views are fine
+template <typename T>
+void matmul_packed(const Matrix<T> &a, const Matrix<T> &b, Matrix<T> &res) {
+    if ((a.depth != 1 && a.depth != res.depth) || (b.depth != 1 && b.depth != res.depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a.depth, b.depth, res.depth);
+        exit(1);
+    }
+    if (a.cols != b.rows || res.rows != a.rows || res.cols != b.cols) {
+        fprintf(stderr, "Shape mismatch: %dx%d * %dx%d -> %dx%d\n", a.rows, a.cols, b.rows, b.cols, res.rows, res.cols);
+        exit(1);
+    }
+    for (int d = 0; d < res.depth; d++) {
+        Matrix<T> as = slice(a, d), bs = slice(b, d), rs = slice(res, d);
+        gemm(as.rows, bs.cols, as.cols, T(1), as.data, as.stride, 1, bs.data, bs.stride, 1, T(0), rs.data, rs.stride);
+    }
+}
+
+// Strassen on top of gemm, one level per call: the operand sums and the C quadrant combines are single
+// fused passes through the expression layer, the seven products recurse until a side drops to cutoff
+// (or goes odd, there gemm takes the whole block), res is overwritten, batched over depth like matmul_packed
+template <typename T>
+void strassens(const Matrix<T> &a, const Matrix<T> &b, Matrix<T> &res, int cutoff = 512) {
+    if ((a.depth != 1 && a.depth != res.depth) || (b.depth != 1 && b.depth != res.depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a.depth, b.depth, res.depth);
+        exit(1);
+    }
+    if (a.cols != b.rows || res.rows != a.rows || res.cols != b.cols) {
+        fprintf(stderr, "Shape mismatch: %dx%d * %dx%d -> %dx%d\n", a.rows, a.cols, b.rows, b.cols, res.rows, res.cols);
+        exit(1);
+    }
+    if (res.depth > 1) {
+        for (int d = 0; d < res.depth; d++) {
+            Matrix<T> rs = slice(res, d);
+            strassens(slice(a, d), slice(b, d), rs, cutoff);
+        }
+        return;
+    }
+    int m = a.rows, k = a.cols, n = b.cols;
+    if (std::min({m, k, n}) <= cutoff || ((m | k | n) & 1)) {
+        gemm(m, n, k, T(1), a.data, a.stride, 1, b.data, b.stride, 1, T(0), res.data, res.stride);
+        return;
+    }
+
+    Matrix<T> a11 = view(a, 0, 0, 0, m / 2, k / 2), a12 = view(a, 0, 0, k / 2, m / 2, k / 2);
+    Matrix<T> a21 = view(a, 0, m / 2, 0, m / 2, k / 2), a22 = view(a, 0, m / 2, k / 2, m / 2, k / 2);
+    Matrix<T> b11 = view(b, 0, 0, 0, k / 2, n / 2), b12 = view(b, 0, 0, n / 2, k / 2, n / 2);
+    Matrix<T> b21 = view(b, 0, k / 2, 0, k / 2, n / 2), b22 = view(b, 0, k / 2, n / 2, k / 2, n / 2);
+    Matrix<T> c11 = view(res, 0, 0, 0, m / 2, n / 2), c12 = view(res, 0, 0, n / 2, m / 2, n / 2);
+    Matrix<T> c21 = view(res, 0, m / 2, 0, m / 2, n / 2), c22 = view(res, 0, m / 2, n / 2, m / 2, n / 2);
+
+    Matrix<T> sa = allocate_matrix_zeros<T>(1, m / 2, k / 2);
+    Matrix<T> sb = allocate_matrix_zeros<T>(1, k / 2, n / 2);
+    Matrix<T> p[7];
+    for (Matrix<T> &pi : p) {
+        pi = allocate_matrix_zeros<T>(1, m / 2, n / 2);
+    }
+
+    sb = b12 - b22;
+    strassens(a11, sb, p[0], cutoff);      // P1 = A11 * (B12 - B22)
+    sa = a11 + a12;
+    strassens(sa, b22, p[1], cutoff);      // P2 = (A11 + A12) * B22
+    sa = a21 + a22;
+    strassens(sa, b11, p[2], cutoff);      // P3 = (A21 + A22) * B11
+    sb = b21 - b11;
+    strassens(a22, sb, p[3], cutoff);      // P4 = A22 * (B21 - B11)
+    sa = a11 + a22;
+    sb = b11 + b22;
+    strassens(sa, sb, p[4], cutoff);       // P5 = (A11 + A22) * (B11 + B22)
+    sa = a12 - a22;
+    sb = b21 + b22;
+    strassens(sa, sb, p[5], cutoff);       // P6 = (A12 - A22) * (B21 + B22)
+    sa = a11 - a21;
+    sb = b11 + b12;
+    strassens(sa, sb, p[6], cutoff);       // P7 = (A11 - A21) * (B11 + B12)
+
+    c11 = p[4] + p[3] - p[1] + p[5];
+    c12 = p[0] + p[1];
+    c21 = p[2] + p[3];
+    c22 = p[0] + p[4] - p[2] - p[6];
+}
+
+// fixed-size products for small shapes known at compile time (3x3, 4x4 transforms and the like),
+// where the packed gemm's packing and edge handling cost far more than the multiply
+// unroll<Count>(f) calls f(integral_constant<0>) ... f(integral_constant<Count - 1>) as a fold, so
+// every index is a constant and the whole product becomes straight-line code the SLP vectorizer packs
+// (the lambdas are always_inline too, past 8x8 GCC stops inlining them and each one becomes a call)
+template <typename F, int... I>
+__attribute__((always_inline)) inline void unroll_impl(F &&f, std::integer_sequence<int, I...>) {
+    (f(std::integral_constant<int, I>{}), ...);
+}
+
+template <int Count, typename F>
+__attribute__((always_inline)) inline void unroll(F &&f) {
+    unroll_impl(f, std::make_integer_sequence<int, Count>{});
+}
+
+// C (M x N) = A (M x K) * B (K x N), row-major with leading dimensions lda/ldb/ldc (contiguous by default)
+// each row of C is built in locals as a sum of scaled rows of B, with no loops and no bounds checks
+template <int M, int N, int K, typename T>
+__attribute__((always_inline)) inline void matmul(const T *a, const T *b, T *c, int lda = K, int ldb = N, int ldc = N) {
+    static_assert(M >= 1 && N >= 1 && K >= 1, "matmul<M, N, K> needs non-empty shapes");
+    static_assert(M <= 16 && N <= 16 && K <= 16, "matmul<M, N, K> is for small shapes, use matmul_packed");
+    unroll<M>([&](auto i) __attribute__((always_inline)) {
+        T row[N];
+        unroll<N>([&](auto j) __attribute__((always_inline)) { row[j] = a[i * lda] * b[j]; });
+        unroll<K - 1>([&](auto p) __attribute__((always_inline)) {
+            unroll<N>([&](auto j) __attribute__((always_inline)) {
+                row[j] += a[i * lda + p + 1] * b[(p + 1) * ldb + j];
+            });
+        });
+        unroll<N>([&](auto j) __attribute__((always_inline)) { c[i * ldc + j] = row[j]; });
+    });
+}
+
+// depth products of contiguous M x K and K x N slices, a_step/b_step are the distances between
+// slices in elements (0 broadcasts one operand), C slices are packed back to back
+template <int M, int N, int K, typename T>
+void matmul_batched(int depth, const T *a, int a_step, const T *b, int b_step, T *c) {
+    for (int d = 0; d < depth; d++) {
+        matmul<M, N, K>(a + (size_t)d * a_step, b + (size_t)d * b_step, c + (size_t)d * M * N);
+    }
+}
+
+// Matrix form, batched over depth with the usual depth-1 broadcasting, views are fine
+// the shapes are checked once against M, N, K, the per-slice work is the unrolled kernel
+template <int M, int N, int K, typename T>
+void matmul(const Matrix<T> &a, const Matrix<T> &b, Matrix<T> &res) {
+    if (a.rows != M || a.cols != K || b.rows != K || b.cols != N || res.rows != M || res.cols != N) {
+        fprintf(stderr, "Shape mismatch: %dx%d * %dx%d -> %dx%d, expected %dx%d * %dx%d\n",
+                a.rows, a.cols, b.rows, b.cols, res.rows, res.cols, M, K, K, N);
+        exit(1);
+    }
+    if ((a.depth != 1 && a.depth != res.depth) || (b.depth != 1 && b.depth != res.depth)) {
+        fprintf(stderr, "Depth mismatch: %d x %d -> %d\n", a.depth, b.depth, res.depth);
+        exit(1);
+    }
+    int a_step = a.depth == 1 ? 0 : a.rows * a.stride;
+    int b_step = b.depth == 1 ? 0 : b.rows * b.stride;
+    int res_step = res.rows * res.stride;
+    for (int d = 0; d < res.depth; d++) {
+        matmul<M, N, K>(a.data + (size_t)d * a_step, b.data + (size_t)d * b_step, res.data + (size_t)d * res_step,
+                        a.stride, b.stride, res.stride);
+    }
+}
+
+}  // namespace matrix
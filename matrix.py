@@ -1,65 +1,225 @@
-import numpy as np
+import ctypes
+import os
+import subprocess
+import tempfile
+import warnings
+from array import array
+
+_HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+class _CMatrix(ctypes.Structure):
+    # mirrors the Matrix struct in matrix.c
+    _fields_ = [
+        ("depth", ctypes.c_int),
+        ("rows", ctypes.c_int),
+        ("cols", ctypes.c_int),
+        ("stride", ctypes.c_int),
+        ("length", ctypes.c_size_t),
+        ("data", ctypes.POINTER(ctypes.c_float)),
+        ("alloc", ctypes.c_int),
+        ("alloc_bytes", ctypes.c_size_t),
+    ]
+
+
+def _load_library():
+    # libmatrix.so is built from matrix.c next to this file on first use (and rebuilt when matrix.c is newer),
+    # MATRIX_LIB points at a prebuilt one instead, MATRIX_NATIVE=0 keeps everything in pure Python
+    # the build goes to a temporary file that is renamed into place, so a concurrent import never loads a
+    # half-written library, and any fallback to the Python loops says why, since they are ~1000x slower
+    if os.environ.get("MATRIX_NATIVE") == "0":
+        return None
+    path = os.environ.get("MATRIX_LIB")
+    if path is None:
+        path = os.path.join(_HERE, "libmatrix.so")
+        source = os.path.join(_HERE, "matrix.c")
+        if not os.path.exists(path) or os.path.getmtime(path) < os.path.getmtime(source):
+            try:
+                fd, tmp = tempfile.mkstemp(dir=_HERE, prefix=".libmatrix-", suffix=".so")
+                os.close(fd)
+            except OSError as e:
+                warnings.warn(f"cannot build {path} ({e}), falling back to pure Python")
+                return None
+            cmd = [os.environ.get("CC", "cc"), "-O3", "-march=native", "-shared", "-fPIC",
+                   "-o", tmp, source, "-lpthread", "-lm"]
+            try:
+                subprocess.run(cmd, check=True, capture_output=True, text=True)
+                os.chmod(tmp, 0o755)
+                os.replace(tmp, path)
+            except subprocess.CalledProcessError as e:
+                os.unlink(tmp)
+                warnings.warn(f"building {path} failed, falling back to pure Python:\n{e.stderr}")
+                return None
+            except OSError as e:
+                os.unlink(tmp)
+                warnings.warn(f"building {path} failed ({e}), falling back to pure Python")
+                return None
+    try:
+        # CDLL (unlike PyDLL) drops the GIL for the duration of every call
+        lib = ctypes.CDLL(path)
+    except OSError as e:
+        warnings.warn(f"cannot load {path} ({e}), falling back to pure Python")
+        return None
+    for name in ("matmul_packed", "matmul_transpose", "add", "sub", "mul"):
+        fn = getattr(lib, name)
+        fn.argtypes = [ctypes.POINTER(_CMatrix)] * 3
+        fn.restype = None
+    lib.matmul_transpose_tiled.argtypes = [ctypes.POINTER(_CMatrix)] * 3 + [ctypes.c_int]
+    lib.matmul_transpose_tiled.restype = None
+    return lib
+
+
+_lib = _load_library()
+
+
+class FloatBuffer(array):
+    # contiguous float32 storage behind Matrix.data, it exports the buffer protocol (memoryview, np.frombuffer)
+    # and still compares equal to a list with the same values, like the list it replaced
+    def __new__(cls, values=()):
+        # float32 arrays are duck-typed (numpy's tobytes() is C order), so numpy stays an optional dependency
+        if isinstance(values, (bytes, bytearray)) or str(getattr(values, "dtype", "")) == "float32":
+            buf = super().__new__(cls, "f")
+            buf.frombytes(values if isinstance(values, (bytes, bytearray)) else values.tobytes())
+            return buf
+        return super().__new__(cls, "f", values)
+
+    def __eq__(self, other):
+        try:
+            return len(self) == len(other) and all(x == y for x, y in zip(self, other))
+        except TypeError:
+            return NotImplemented
+
+    def __ne__(self, other):
+        eq = self.__eq__(other)
+        return eq if eq is NotImplemented else not eq
+
+    __hash__ = None
+
+
+def _native(name, a, b, res):
+    # the C Matrix assumes slices are packed back to back (depth pitch = rows * stride), a view cut out of a
+    # deeper parent's rows is not, so it is handed over one depth slice at a time
+    fn = getattr(_lib, name)
+    if all(m._depth_packed() for m in (a, b, res)):
+        fn(a._as_c(), b._as_c(), res._as_c())
+    else:
+        for d in range(res.shape[0]):
+            fn(a[d]._as_c(), b[d]._as_c(), res[d]._as_c())
+
 
 class Matrix:
     # 3d implemented with strided representation in row-major order
     # matrices are treated as depth-number of stacked 2d matrices
+    # slicing returns a view: it shares data with its parent and only has its own shape and offset,
+    # so data is the whole underlying buffer and a view's elements start at offset, stepping by stride
     def __init__(self, d=1, h=1, w=1, data=None, verbose=False):
         self.shape = (d, h, w)
         self.size = d * h * w
         self.stride = (h * w, w, 1)
+        self.offset = 0
         if data is not None:
             assert len(data) == self.size
-            self.data = data
+            self.data = data if isinstance(data, FloatBuffer) else FloatBuffer(data)
         else:
-            self.data = [0 for _ in range(h) for _ in range(d) for _ in range(w)]
-            # self.data = [1 ,2 ,3 ,4]
+            self.data = FloatBuffer(bytes(4 * self.size))
         self.verbose = verbose
 
+    def _view(self, shape, offset):
+        view = Matrix.__new__(Matrix)
+        view.shape = shape
+        view.size = shape[0] * shape[1] * shape[2]
+        view.stride = self.stride
+        view.offset = offset
+        view.data = self.data
+        view.verbose = self.verbose
+        return view
+
+    def _depth_packed(self):
+        return self.shape[0] == 1 or self.stride[0] == self.shape[1] * self.stride[1]
+
+    def is_contiguous(self):
+        return self._depth_packed() and (self.shape[1] == 1 or self.stride[1] == self.shape[2])
+
+    def _row_offsets(self):
+        for d in range(self.shape[0]):
+            for h in range(self.shape[1]):
+                yield self.offset + d * self.stride[0] + h * self.stride[1]
+
+    def tolist(self):
+        if self.is_contiguous():
+            return self.data[self.offset:self.offset + self.size].tolist()
+        w = self.shape[2]
+        return [x for o in self._row_offsets() for x in self.data[o:o + w]]
+
+    def copy(self):
+        # a fresh contiguous matrix with this view's elements
+        temp = Matrix(self.shape[0], self.shape[1], self.shape[2])
+        temp[:] = self
+        return temp
+
+    @property
+    def __array_interface__(self):
+        # lets np.asarray(m) wrap the storage without a copy, writes through the array show up in m
+        return {
+            "shape": self.shape,
+            "typestr": "<f4",
+            "data": (self.data.buffer_info()[0] + 4 * self.offset, False),
+            "strides": tuple(4 * s for s in self.stride),
+            "version": 3,
+        }
+
+    def _as_c(self):
+        ptr = ctypes.cast(self.data.buffer_info()[0] + 4 * self.offset, ctypes.POINTER(ctypes.c_float))
+        return _CMatrix(self.shape[0], self.shape[1], self.shape[2], self.stride[1], self.size, ptr)
 
     def __getitem__(self, idx):
         if self.verbose: print(f"__getitem__ idx={idx} for {self.__repr__()}")
         idx = list(idx) if isinstance(idx, tuple) else [idx]
         idx = list(idx) + [slice(None, None) for _ in range(3-len(idx))]
+        if not any(isinstance(i, slice) for i in idx):
+            return self.data[self._get_strided(*idx)]
 
+        # an integer index keeps its axis with size 1, the result is always a 3d view
+        shape, offset = [], self.offset
         for i in range(len(idx)):
             if isinstance(idx[i], slice):
-                start, stop = idx[i].start, idx[i].stop
-                start = 0 if start is None else start
-                stop = self.shape[i] if stop is None else stop
-                idx[i] = (start, stop)
+                start, stop, step = idx[i].indices(self.shape[i])
+                assert step == 1, "only unit-step slices are supported"
+                stop = max(start, stop)
             else:
-                idx[i] = (idx[i], idx[i] + 1)
-        if self.verbose: print(f"idx: {idx}")
-            
-        temp = []
-        if self.verbose: print("stride:", self.stride)
-        for d in range(idx[0][0], idx[0][1]):
-            for h in range(idx[1][0], idx[1][1]):
-                for w in range(idx[2][0], idx[2][1]):
-                    if self.verbose: print("  d, h, w:", d, h, w)
-                    strided_idx = self._get_strided(d, h, w)
-                    temp.append(self.data[strided_idx])
-
-        if len(temp) > 1:
-            return Matrix(idx[2][1] - idx[2][0], idx[0][1] - idx[0][0], idx[1][1] - idx[1][0], temp)
-        else:
-            return temp[0]
+                start, stop = idx[i], idx[i] + 1
+            shape.append(stop - start)
+            offset += start * self.stride[i]
+        if self.verbose: print(f"view shape={shape} offset={offset} stride={self.stride}")
+        return self._view(tuple(shape), offset)
 
     def _get_strided(self, d, h, w):
-        strided_idx = d * self.stride[0] + h * self.stride[1] + w * self.stride[2]
+        strided_idx = self.offset + d * self.stride[0] + h * self.stride[1] + w * self.stride[2]
         if self.verbose: print("  strided:", strided_idx)
         return strided_idx
     
     def __setitem__(self, idx, item):
-        d, h, w = idx
-        strided_idx = self._get_strided(d, h, w)
-        self.data[strided_idx] = item.data[0] if isinstance(item, Matrix) and item.size == 1 else item
+        if isinstance(idx, tuple) and len(idx) == 3 and not any(isinstance(i, slice) for i in idx):
+            d, h, w = idx
+            strided_idx = self._get_strided(d, h, w)
+            self.data[strided_idx] = item.data[item.offset] if isinstance(item, Matrix) and item.size == 1 else item
+            return
+
+        # slice assignment copies item into this matrix's storage (and so into every view sharing it) row by row
+        view = self[idx]
+        assert isinstance(item, Matrix) and item.shape == view.shape, f"can only assign a matrix of shape {view.shape}"
+        w = view.shape[2]
+        for dst, src in zip(view._row_offsets(), item._row_offsets()):
+            view.data[dst:dst + w] = item.data[src:src + w]
 
     def __matmul__(self, other):
         assert self.shape[2] == other.shape[1], f"incompatible shapes for matmul: {self.shape[2]} != {other.shape[1]}" 
         assert self.shape[0] == other.shape[0], f"incompatible depth shapes for matmul: {self.shape[0]} != {other.shape[0]}"
 
         temp = Matrix(self.shape[0], self.shape[1], other.shape[2])
+        if _lib is not None:
+            _native("matmul_packed", self, other, temp)
+            return temp
         if self.verbose: print(f"matmul on self={self.shape}, other={other.shape}")
         for d in range(self.shape[0]):
             for h in range(self.shape[1]):
@@ -73,10 +233,13 @@ class Matrix:
 
         return temp
     
-    def _matrix_matrix_op(self, other, op):
+    def _matrix_matrix_op(self, other, op, native=None, out=None):
         assert self.shape == other.shape, f"can only element-wise operate same sized matrices: {self.shape} != {other.shape}" 
 
-        temp = Matrix(self.shape[0], self.shape[1], self.shape[2])
+        temp = Matrix(self.shape[0], self.shape[1], self.shape[2]) if out is None else out
+        if native is not None and _lib is not None:
+            _native(native, self, other, temp)
+            return temp
         for d in range(self.shape[0]):
             for h in range(self.shape[1]):
                 for w in range(self.shape[2]):
@@ -84,17 +247,27 @@ class Matrix:
 
         return temp
     
+    # in-place forms write straight into the storage, on a view that is the parent's
+    def __iadd__(self, other):
+        return self._matrix_matrix_op(other, lambda x, y: x + y, "add", out=self)
+
+    def __isub__(self, other):
+        return self._matrix_matrix_op(other, lambda x, y: x - y, "sub", out=self)
+
+    def __imul__(self, other):
+        return self._matrix_matrix_op(other, lambda x, y: x * y, "mul", out=self)
+
     def __mul__(self, other):
         assert self.shape == other.shape, f"can only scalar multiply same sized matrices: {self.shape} != {other.shape}" 
-        return self._matrix_matrix_op(other, lambda x, y: x * y)
+        return self._matrix_matrix_op(other, lambda x, y: x * y, "mul")
     
     def __add__(self, other):
         assert self.shape == other.shape, f"can only scalar add same sized matrices: {self.shape} != {other.shape}" 
-        return self._matrix_matrix_op(other, lambda x, y: x + y)
+        return self._matrix_matrix_op(other, lambda x, y: x + y, "add")
     
     def __sub__(self, other):
         assert self.shape == other.shape, f"can only scalar subtract same sized matrices: {self.shape} != {other.shape}" 
-        return self._matrix_matrix_op(other, lambda x, y: x - y)
+        return self._matrix_matrix_op(other, lambda x, y: x - y, "sub")
     
     def __truediv__(self, other):
         assert self.shape == other.shape, f"can only scalar divide same sized matrices: {self.shape} != {other.shape}" 
@@ -110,7 +283,7 @@ class Matrix:
         #     for h in range(self.shape[1]):
         #         repr += f"{self[d, h, :].data}\n"
         # return repr
-        return str(self.data)
+        return str(self.tolist())
 
     def __repr__(self):
         return "Matrix("+str(self.__dict__)+")"
@@ -1,10 +1,11 @@
 from matrix import Matrix
 
 def split(m):
+    # quadrants as views into m (a b / c d), nothing is copied
     n = m.shape[1] // 2
     a = m[:, :n, :n]
-    b = m[:, n:, :n]
-    c = m[:, :n, n:]
+    b = m[:, :n, n:]
+    c = m[:, n:, :n]
     d = m[:, n:, n:]
     return a, b, c, d
 
@@ -13,7 +14,7 @@ def strassens_dnq(A, B):
     Vanilla divide and conquer approach, with time complexity same
     as normal matmul, for testing purposes
     """
-    if not A.shape == B.shape and A.shape[1]//2 == 0:
+    if A.shape != B.shape or A.shape[1] != A.shape[2] or A.shape[1] % 2 != 0:
         return A @ B
     elif A.shape[1] <= 2:
         return A @ B
@@ -30,19 +31,22 @@ def strassens_dnq(A, B):
         cf = strassens_dnq(c, f)
         dh = strassens_dnq(d, h)
 
-        C11 = ae + bg
-        C12 = af + bh
-        C21 = ce + dg
-        C22 = cf + dh
-
-        C = Matrix(C11.shape[0], C11.shape[1], C11.shape[1], 
-                data=C11.data + C12.data + C21.data + C22.data           
-            )
+        # the quadrants of C are views, results are written straight into it
+        C = Matrix(A.shape[0], A.shape[1], A.shape[2])
+        C11, C12, C21, C22 = split(C)
+        C11[:] = ae
+        C11 += bg
+        C12[:] = af
+        C12 += bh
+        C21[:] = ce
+        C21 += dg
+        C22[:] = cf
+        C22 += dh
 
         return C
 
 def strassens(A, B):
-    if not A.shape != B.shape and A.shape[1]//2 != 0:
+    if A.shape != B.shape or A.shape[1] != A.shape[2] or A.shape[1] % 2 != 0:
         return A @ B
     elif A.shape[1] <= 2:
         return A @ B
@@ -58,13 +62,19 @@ def strassens(A, B):
         p6 = strassens(b - d, g + h)
         p7 = strassens(a - c, e + f)
 
-        C11 = p5 + p4 - p2 + p6
-        C12 = p1 + p2
-        C21 = p3 + p4
-        C22 = p1 + p5 - p3 - p7
-
-        C = Matrix(C11.shape[0], C11.shape[1], C11.shape[1], 
-                data=C11.data + C12.data + C21.data + C22.data           
-            )
+        C = Matrix(A.shape[0], A.shape[1], A.shape[2])
+        C11, C12, C21, C22 = split(C)
+        C11[:] = p5
+        C11 += p4
+        C11 -= p2
+        C11 += p6
+        C12[:] = p1
+        C12 += p2
+        C21[:] = p3
+        C21 += p4
+        C22[:] = p1
+        C22 += p5
+        C22 -= p3
+        C22 -= p7
 
         return C
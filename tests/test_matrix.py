@@ -87,7 +87,7 @@ class TestMatrix(unittest.TestCase):
         with self.subTest("matrix x matrix (2D square)"):
             m5 = Matrix(1, 4, 4, [i for i in range(16)])
             m6 = Matrix(1, 4, 4, [i for i in range(16)])
-            result = strassens(m5, m6)
+            result = strassens_dnq(m5, m6)
             self.assertEqual(result.data, [ 56,  62,  68,  74, 152, 174, 196, 218, 248, 286, 324, 362, 344,
        398, 452, 506])
             self.assertEqual(result.shape, (1, 4, 4))
@@ -96,12 +96,91 @@ class TestMatrix(unittest.TestCase):
         with self.subTest("matrix x matrix (3D square)"):
             m9 = Matrix(2, 4, 4, [i for i in range(32)])
             m10 = Matrix(2, 4, 4, [i for i in range(32)])
-            result = strassens(m9, m10)
+            result = strassens_dnq(m9, m10)
             self.assertEqual(result.data, [  56,   62,   68,   74,  152,  174,  196,  218,  248,  286,  324,
         362,  344,  398,  452,  506, 1560, 1630, 1700, 1770, 1912, 1998,
        2084, 2170, 2264, 2366, 2468, 2570, 2616, 2734, 2852, 2970])
             self.assertEqual(result.shape, (2, 4, 4))
 
+    def test_matrix_elementwise(self):
+        m1 = Matrix(2, 2, 3, [i for i in range(12)])
+        m2 = Matrix(2, 2, 3, [2 * i + 1 for i in range(12)])
+        self.assertEqual((m1 + m2).data, [3 * i + 1 for i in range(12)])
+        self.assertEqual((m1 - m2).data, [-i - 1 for i in range(12)])
+        self.assertEqual((m1 * m2).data, [i * (2 * i + 1) for i in range(12)])
+        self.assertEqual((m1 + m2).shape, (2, 2, 3))
+
+    def test_matrix_numpy_zero_copy(self):
+        import numpy as np
+        m = Matrix(2, 3, 4, [i for i in range(24)])
+        a = np.asarray(m)
+        self.assertEqual(a.shape, (2, 3, 4))
+        self.assertEqual(a.dtype, np.float32)
+        a[1, 2, 3] = -1
+        self.assertEqual(m[1, 2, 3], -1)
+        self.assertTrue(np.shares_memory(a, np.frombuffer(m.data, dtype=np.float32)))
+
+        # large enough that the packed kernels actually block, checked against numpy
+        rng = np.random.default_rng(0)
+        x = rng.random((1, 67, 131), dtype=np.float32)
+        y = rng.random((1, 131, 45), dtype=np.float32)
+        result = Matrix(1, 67, 131, x.ravel()) @ Matrix(1, 131, 45, y.ravel())
+        np.testing.assert_allclose(np.asarray(result), x @ y, rtol=1e-4)
+
+    def test_matrix_views(self):
+        m = Matrix(2, 4, 4, [i for i in range(32)])
+        with self.subTest("slices share storage"):
+            q = m[:, 2:, :2]
+            self.assertEqual(q.shape, (2, 2, 2))
+            self.assertIs(q.data, m.data)
+            self.assertEqual(q.tolist(), [8, 9, 12, 13, 24, 25, 28, 29])
+            self.assertEqual(q[1, 1, 0], 28)
+            q[0, 0, 1] = -9
+            self.assertEqual(m[0, 2, 1], -9)
+
+        with self.subTest("quadrant writes go into the parent"):
+            c = Matrix(2, 4, 4)
+            c[:, :2, 2:] = m[:, 2:, :2]
+            view = c[:, 2:, 2:]
+            view += m[:, :2, :2]
+            self.assertEqual(c[:, :2, 2:].tolist(), [8, -9, 12, 13, 24, 25, 28, 29])
+            self.assertEqual(c[:, 2:, 2:].tolist(), [0, 1, 4, 5, 16, 17, 20, 21])
+            self.assertEqual(c[:, :, :2].tolist(), [0] * 16)
+
+        with self.subTest("ops on views"):
+            import numpy as np
+            a, b = m[:, 1:3, 1:4], m[:, :2, :3]
+            self.assertEqual((a + b).tolist(), list((np.asarray(a) + np.asarray(b)).ravel()))
+            self.assertEqual((m[:, :3, 1:] @ m[:, 1:, :3]).tolist(),
+                             list((np.asarray(m)[:, :3, 1:] @ np.asarray(m)[:, 1:, :3]).ravel()))
+
+    def test_matrix_transpose_kernels_padded_stride(self):
+        # wide rows padded the way MATRIX_PAD_STRIDE=1 pads them (130 -> 144), here as views of wider parents,
+        # so B is neither square nor contiguous, and the kernels have to leave it as it was
+        import numpy as np
+        import matrix
+        if matrix._lib is None:
+            self.skipTest("no native library")
+        rng = np.random.default_rng(1)
+        x = rng.random((2, 130, 80), dtype=np.float32)
+        y = rng.random((2, 70, 144), dtype=np.float32)
+        A = Matrix(2, 130, 80, x.ravel())[:, :, :70]
+        B = Matrix(2, 70, 144, y.ravel())[:, :, :130]
+        for name, extra in (("matmul_transpose", ()), ("matmul_transpose_tiled", (0,))):
+            with self.subTest(name):
+                res = Matrix(2, 130, 144)[:, :, :130]
+                getattr(matrix._lib, name)(A._as_c(), B._as_c(), res._as_c(), *extra)
+                np.testing.assert_allclose(np.asarray(res), x[:, :, :70] @ y[:, :, :130], rtol=1e-4)
+                np.testing.assert_array_equal(np.asarray(B), y[:, :, :130])
+
+    def test_matrix_strassens_larger(self):
+        import numpy as np
+        x = np.arange(2 * 16 * 16, dtype=np.float32).reshape(2, 16, 16) % 7
+        y = np.arange(2 * 16 * 16, dtype=np.float32).reshape(2, 16, 16) % 5
+        A, B = Matrix(2, 16, 16, x.ravel()), Matrix(2, 16, 16, y.ravel())
+        self.assertEqual(strassens(A, B).tolist(), list((x @ y).ravel()))
+        self.assertEqual(strassens_dnq(A, B).tolist(), list((x @ y).ravel()))
+
 
 if __name__ == "__main__":
     unittest.main()